@@ -28,6 +28,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h> /* sync_file_range */
+#include <libgen.h> /* dirname */
 #include <inttypes.h> /* int64_t */
 #include <stdint.h> /* intmax_t */
 
@@ -49,6 +51,7 @@
 #include "deps.h"
 #include "remove.h"
 #include "handle.h"
+#include "decompress.h"
 
 int _alam_add_loadtarget(amtrans_t *trans, amdb_t *db, char *name)
 {
@@ -99,9 +102,100 @@ error:
 	return(-1);
 }
 
+/* Name a file is extracted to with the syncextract option, until it is
+ * renamed into place. Returns -1 if the name would be too long. */
+static int pending_name(char *tmpname, const char *filename)
+{
+	if(snprintf(tmpname, PATH_MAX, "%s.pactmp", filename) >= PATH_MAX) {
+		return(-1);
+	}
+	return(0);
+}
+
+/* Write the files extracted under temporary names to disk, rename them to
+ * their real names and write the directories holding them. Returns the
+ * number of errors. */
+static int pending_commit(alam_list_t **pending)
+{
+	alam_list_t *i, *dirs = NULL;
+	char tmpname[PATH_MAX];
+	int errors = 0;
+
+	if(*pending == NULL) {
+		return(0);
+	}
+
+	_alam_log(AM_LOG_DEBUG, "syncing %d extracted files\n",
+			alam_list_count(*pending));
+
+#ifdef SYNC_FILE_RANGE_WRITE
+	/* start the writeback of every file before waiting on any, so they go
+	 * to the disk as one batch instead of one flush per file */
+	for(i = *pending; i; i = i->next) {
+		int fd;
+		pending_name(tmpname, i->data);
+		if((fd = open(tmpname, O_RDONLY)) != -1) {
+			sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+			close(fd);
+		}
+	}
+#endif
+
+	for(i = *pending; i; i = i->next) {
+		const char *filename = i->data;
+		int fd;
+
+		pending_name(tmpname, filename);
+		if((fd = open(tmpname, O_RDONLY)) == -1 || fsync(fd) != 0) {
+			_alam_log(AM_LOG_ERROR, _("could not sync %s (%s)\n"),
+					tmpname, strerror(errno));
+			alam_logaction("error: could not sync %s (%s)\n",
+					tmpname, strerror(errno));
+			errors++;
+		}
+		if(fd != -1) {
+			close(fd);
+		}
+	}
+
+	for(i = *pending; i; i = i->next) {
+		const char *filename = i->data;
+		char dir[PATH_MAX];
+
+		pending_name(tmpname, filename);
+		if(rename(tmpname, filename)) {
+			_alam_log(AM_LOG_ERROR, _("could not rename %s to %s (%s)\n"),
+					tmpname, filename, strerror(errno));
+			alam_logaction("error: could not rename %s to %s (%s)\n",
+					tmpname, filename, strerror(errno));
+			unlink(tmpname);
+			errors++;
+			continue;
+		}
+		/* dirname() may modify its argument */
+		strcpy(dir, filename);
+		if(!alam_list_find_str(dirs, dirname(dir))) {
+			dirs = alam_list_add(dirs, strdup(dirname(dir)));
+		}
+	}
+
+	/* make the renames themselves durable */
+	for(i = dirs; i; i = i->next) {
+		int fd = open(i->data, O_RDONLY | O_DIRECTORY);
+		if(fd != -1) {
+			fsync(fd);
+			close(fd);
+		}
+	}
+
+	FREELIST(dirs);
+	FREELIST(*pending);
+	return(errors);
+}
+
 static int extract_single_file(struct archive *archive,
 		struct archive_entry *entry, ampkg_t *newpkg, ampkg_t *oldpkg,
-		amtrans_t *trans, amdb_t *db)
+		amtrans_t *trans, amdb_t *db, alam_list_t **pending)
 {
 	const char *entryname;
 	mode_t entrymode;
@@ -399,6 +493,8 @@ static int extract_single_file(struct archive *archive,
 		FREE(hash_pkg);
 		FREE(hash_orig);
 	} else {
+		const char *extractname = filename;
+		char tmpname[PATH_MAX];
 		int ret;
 
 		/* we didn't need a backup */
@@ -412,14 +508,25 @@ static int extract_single_file(struct archive *archive,
 			_alam_log(AM_LOG_DEBUG, "extracting %s\n", filename);
 		}
 
-		if(trans->flags & AM_TRANS_FLAG_FORCE) {
+		if(pending && archive_entry_hardlink(entry)) {
+			/* the link target has to be in place already */
+			errors += pending_commit(pending);
+		}
+
+		if(pending && S_ISREG(entrymode) && archive_entry_hardlink(entry) == NULL
+				&& pending_name(tmpname, filename) == 0) {
+			/* rename() replaces the file in one go, no need for the unlink
+			 * below; a leftover from an earlier crash goes away though */
+			unlink(tmpname);
+			extractname = tmpname;
+		} else if(trans->flags & AM_TRANS_FLAG_FORCE) {
 			/* if FORCE was used, unlink() each file (whether it's there
 			 * or not) before extracting. This prevents the old "Text file busy"
 			 * error that crops up if forcing a glibc or pacman upgrade. */
 			unlink(filename);
 		}
 
-		archive_entry_set_pathname(entry, filename);
+		archive_entry_set_pathname(entry, extractname);
 
 		ret = archive_read_extract(archive, entry, archive_flags);
 		if(ret == ARCHIVE_WARN) {
@@ -432,9 +539,16 @@ static int extract_single_file(struct archive *archive,
 			alam_logaction("error: could not extract %s (%s)\n",
 					entryname_orig, archive_error_string(archive));
 			FREE(entryname_orig);
+			if(extractname != filename) {
+				unlink(extractname);
+			}
 			return(1);
 		}
 
+		if(extractname != filename) {
+			*pending = alam_list_add(*pending, strdup(filename));
+		}
+
 		/* calculate an hash if this is in newpkg's backup */
 		alam_list_t *b;
 		for(b = alam_pkg_get_backup(newpkg); b; b = b->next) {
@@ -448,7 +562,7 @@ static int extract_single_file(struct archive *archive,
 			}
 			_alam_log(AM_LOG_DEBUG, "appending backup entry for %s\n", filename);
 
-			hash = alam_compute_md5sum(filename);
+			hash = alam_compute_md5sum(extractname);
 			MALLOC(backup, backup_len, RET_ERR(AM_ERR_MEMORY, -1));
 
 			sprintf(backup, "%s\t%s", oldbackup, hash);
@@ -469,6 +583,10 @@ static int commit_single_pkg(ampkg_t *newpkg, int pkg_current, int pkg_count,
 	char scriptlet[PATH_MAX+1];
 	int is_upgrade = 0;
 	ampkg_t *oldpkg = NULL;
+	/* an uncompressed copy made while loading the package is read instead
+	 * of the package file, see _alam_pkg_load_spooled() */
+	const char *pkgfile = newpkg->spool ? newpkg->spool : newpkg->origin_data.file;
+	off_t pkgsize = newpkg->size;
 
 	ALAM_LOG_FUNC;
 
@@ -495,7 +613,7 @@ static int commit_single_pkg(ampkg_t *newpkg, int pkg_current, int pkg_count,
 
 		/* pre_upgrade scriptlet */
 		if(alam_pkg_has_scriptlet(newpkg) && !(trans->flags & AM_TRANS_FLAG_NOSCRIPTLET)) {
-			_alam_runscriptlet(handle->root, newpkg->origin_data.file,
+			_alam_runscriptlet(handle->root, pkgfile,
 					"pre_upgrade", newpkg->version, oldpkg->version, trans);
 		}
 	} else {
@@ -507,7 +625,7 @@ static int commit_single_pkg(ampkg_t *newpkg, int pkg_current, int pkg_count,
 
 		/* pre_install scriptlet */
 		if(alam_pkg_has_scriptlet(newpkg) && !(trans->flags & AM_TRANS_FLAG_NOSCRIPTLET)) {
-			_alam_runscriptlet(handle->root, newpkg->origin_data.file,
+			_alam_runscriptlet(handle->root, pkgfile,
 					"pre_install", newpkg->version, NULL, trans);
 		}
 	}
@@ -542,22 +660,19 @@ static int commit_single_pkg(ampkg_t *newpkg, int pkg_current, int pkg_count,
 		struct archive *archive;
 		struct archive_entry *entry;
 		char cwd[PATH_MAX] = "";
+		alam_list_t *pending = NULL;
+		int64_t rawpos;
 
 		_alam_log(AM_LOG_DEBUG, "extracting files\n");
 
-		if ((archive = archive_read_new()) == NULL) {
-			am_errno = AM_ERR_LIBARCHIVE;
-			ret = -1;
-			goto cleanup;
+		_alam_log(AM_LOG_DEBUG, "archive: %s\n", pkgfile);
+		if(newpkg->spool) {
+			struct stat st;
+			if(stat(pkgfile, &st) == 0) {
+				pkgsize = st.st_size;
+			}
 		}
-
-		archive_read_support_compression_all(archive);
-		archive_read_support_format_all(archive);
-
-		_alam_log(AM_LOG_DEBUG, "archive: %s\n", newpkg->origin_data.file);
-		if(archive_read_open_filename(archive, newpkg->origin_data.file,
-					ARCHIVE_DEFAULT_BYTES_PER_BLOCK) != ARCHIVE_OK) {
-			am_errno = AM_ERR_PKG_OPEN;
+		if((archive = _alam_archive_open(pkgfile, &rawpos)) == NULL) {
 			ret = -1;
 			goto cleanup;
 		}
@@ -583,15 +698,16 @@ static int commit_single_pkg(ampkg_t *newpkg, int pkg_current, int pkg_count,
 		for(i = 0; archive_read_next_header(archive, &entry) == ARCHIVE_OK; i++) {
 			double percent;
 
-			if(newpkg->size != 0) {
+			if(pkgsize != 0) {
 				/* Using compressed size for calculations here, as newpkg->isize is not
 				 * exact when it comes to comparing to the ACTUAL uncompressed size
-				 * (missing metadata sizes) */
-				int64_t pos = archive_position_compressed(archive);
-				percent = (double)pos / (double)newpkg->size;
+				 * (missing metadata sizes). libarchive only knows the decompressed
+				 * position of the packages we decode ourselves. */
+				int64_t pos = rawpos >= 0 ? rawpos : archive_position_compressed(archive);
+				percent = (double)pos / (double)pkgsize;
 				_alam_log(AM_LOG_DEBUG, "decompression progress: "
 						"%f%% (%"PRId64" / %jd)\n",
-						percent*100.0, pos, (intmax_t)newpkg->size);
+						percent*100.0, pos, (intmax_t)pkgsize);
 				if(percent >= 1.0) {
 					percent = 1.0;
 				}
@@ -611,10 +727,19 @@ static int commit_single_pkg(ampkg_t *newpkg, int pkg_current, int pkg_count,
 
 			/* extract the next file from the archive */
 			errors += extract_single_file(archive, entry, newpkg, oldpkg,
-					trans, db);
+					trans, db, handle->syncextract ? &pending : NULL);
 		}
 		archive_read_finish(archive);
 
+		/* everything has to be on disk before the db says it is installed */
+		errors += pending_commit(&pending);
+
+		/* the copy is not needed anymore, free the space early */
+		if(newpkg->spool) {
+			unlink(newpkg->spool);
+			FREE(newpkg->spool);
+		}
+
 		/* restore the old cwd is we have it */
 		if(strlen(cwd)) {
 			chdir(cwd);
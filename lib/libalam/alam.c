@@ -28,6 +28,8 @@
 #include "alam_list.h"
 #include "handle.h"
 #include "util.h"
+#include "dload.h"
+#include "mirror.h"
 
 /* Globals */
 enum _amerrno_t am_errno SYMEXPORT;
@@ -50,6 +52,12 @@ int SYMEXPORT alam_initialize(void)
 		RET_ERR(AM_ERR_MEMORY, -1);
 	}
 
+	if(_alam_dload_init() == -1) {
+		_alam_handle_free(handle);
+		handle = NULL;
+		return(-1);
+	}
+
 #ifdef ENABLE_NLS
 	bindtextdomain("libalam", LOCALEDIR);
 #endif
@@ -70,7 +78,10 @@ int SYMEXPORT alam_release(void)
 		return(-1);
 	}
 
+	/* the scores of downloads outside a transaction, e.g. db updates */
+	_alam_mirror_save();
 	_alam_handle_free(handle);
+	_alam_dload_release();
 
 	return(0);
 }
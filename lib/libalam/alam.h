@@ -81,8 +81,23 @@ int alam_logaction(char *fmt, ...);
  * Downloading
  */
 
+/** A callback for download progress
+ * With parallel downloads (see alam_option_set_paralleldownloads()), the
+ * calls for several files interleave; they are never made at the same
+ * time, and the calls for one file still start at 0 and, once it is
+ * received, end with xfered equal to total. A frontend showing overall
+ * progress has to keep the progress of each file by filename rather than
+ * assume that a file is done once the next one shows up.
+ * @param filename the file being downloaded
+ * @param xfered the bytes of the file received so far
+ * @param total the size of the file
+ */
 typedef void (*alam_cb_download)(const char *filename,
 		off_t xfered, off_t total);
+/** A callback for the size of all the files about to be downloaded,
+ * called with 0 once they are done
+ * @param total the size of the files
+ */
 typedef void (*alam_cb_totaldl)(off_t total);
 /** A callback for downloading files
  * @param url the URL of the file to be downloaded
@@ -157,6 +172,45 @@ void alam_option_set_arch(const char *arch);
 
 void alam_option_set_usedelta(unsigned short usedelta);
 
+/* Downloading more than one file at a time requires a fetch callback that
+ * can be called from several threads. The download and log callbacks are
+ * never entered concurrently, but calls for different files interleave.
+ * This is a library option only: aurman does not download packages
+ * through libalam and leaves it unset. */
+unsigned short alam_option_get_paralleldownloads();
+void alam_option_set_paralleldownloads(unsigned short paralleldl);
+
+unsigned short alam_option_get_maxmirrorconns();
+void alam_option_set_maxmirrorconns(unsigned short mirrorconns);
+
+/* Order servers by the speed measured in earlier downloads, which is kept
+ * in dbpath/mirrors. */
+unsigned short alam_option_get_rankmirrors();
+void alam_option_set_rankmirrors(unsigned short rankmirrors);
+
+/* Files of at least twice segmentsize are fetched in byte ranges of at
+ * least segmentsize from several http servers at once, unless several
+ * files are downloaded in parallel. Only used by the libcurl downloader. */
+off_t alam_option_get_segmentsize();
+void alam_option_set_segmentsize(off_t segmentsize);
+
+/* Packages that are not cached yet are downloaded to a private directory
+ * of the stage dir, installed from there and dropped instead of being
+ * kept in the cache. The cachedir is used when no stage dir is set or it
+ * is too small for the download. A stage dir on a memory backed
+ * filesystem such as /dev/shm keeps the packages off the disk. */
+unsigned short alam_option_get_streaminstall();
+void alam_option_set_streaminstall(unsigned short streaminstall);
+
+const char *alam_option_get_stagedir();
+int alam_option_set_stagedir(const char *stagedir);
+
+/* Package files are extracted under temporary names, written to disk
+ * together once the whole package is out and then renamed into place,
+ * so a crash never leaves a half written file behind. */
+unsigned short alam_option_get_syncextract();
+void alam_option_set_syncextract(unsigned short syncextract);
+
 amdb_t *alam_option_get_localdb();
 alam_list_t *alam_option_get_syncdbs();
 
@@ -212,6 +266,7 @@ time_t alam_pkg_get_builddate(ampkg_t *pkg);
 time_t alam_pkg_get_installdate(ampkg_t *pkg);
 const char *alam_pkg_get_packager(ampkg_t *pkg);
 const char *alam_pkg_get_md5sum(ampkg_t *pkg);
+const char *alam_pkg_get_sha256sum(ampkg_t *pkg);
 const char *alam_pkg_get_arch(ampkg_t *pkg);
 off_t alam_pkg_get_size(ampkg_t *pkg);
 off_t alam_pkg_get_isize(ampkg_t *pkg);
@@ -466,6 +521,7 @@ const char *alam_fileconflict_get_ctarget(amfileconflict_t *conflict);
 
 /* checksums */
 char *alam_compute_md5sum(const char *name);
+char *alam_compute_sha256sum(const char *name);
 
 /* compress */
 int alam_pack(const char *archive, const char *prefix, const char **fn);
@@ -530,6 +586,7 @@ enum _amerrno_t {
 	/* External library errors */
 	AM_ERR_LIBARCHIVE,
 	AM_ERR_LIBFETCH,
+	AM_ERR_LIBCURL,
 	AM_ERR_EXTERNAL_DOWNLOAD
 };
 
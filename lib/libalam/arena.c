@@ -0,0 +1,222 @@
+/*
+ *  arena.c
+ *
+ *  Copyright (c) 2006-2009 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* libalam */
+#include "arena.h"
+#include "util.h"
+#include "log.h"
+#include "alam.h"
+
+/* size of the blocks strings are carved from; larger requests get a block
+ * of their own */
+#define ARENA_BLOCKSIZE (64 * 1024)
+/* initial number of slots in the intern table, a power of two */
+#define ARENA_INTERN_SLOTS 1024
+
+struct arena_block {
+	struct arena_block *next;
+	size_t used;
+	size_t size;
+	/* union for the alignment of the data that follows */
+	union {
+		void *p;
+		long double d;
+		intmax_t i;
+	} data[];
+};
+
+struct _amarena_t {
+	struct arena_block *blocks;
+	/* interned strings, open addressing with linear probing */
+	char **intern;
+	size_t slots;
+	size_t count;
+};
+
+amarena_t *_alam_arena_new(void)
+{
+	amarena_t *arena;
+
+	CALLOC(arena, 1, sizeof(amarena_t), RET_ERR(AM_ERR_MEMORY, NULL));
+	return(arena);
+}
+
+void _alam_arena_free(amarena_t *arena)
+{
+	struct arena_block *block, *next;
+
+	if(arena == NULL) {
+		return;
+	}
+	for(block = arena->blocks; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	free(arena->intern);
+	free(arena);
+}
+
+static struct arena_block *arena_block_new(size_t size)
+{
+	struct arena_block *block;
+
+	MALLOC(block, sizeof(struct arena_block) + size,
+			RET_ERR(AM_ERR_MEMORY, NULL));
+	block->size = size;
+	return(block);
+}
+
+/* Carve size bytes aligned to align (a power of two) from the arena. */
+static void *arena_take(amarena_t *arena, size_t size, size_t align)
+{
+	struct arena_block *block = arena->blocks;
+	size_t offset;
+
+	if(block) {
+		offset = (block->used + align - 1) & ~(align - 1);
+		if(offset + size <= block->size) {
+			block->used = offset + size;
+			return((char *)block->data + offset);
+		}
+	}
+
+	if(size > ARENA_BLOCKSIZE / 4) {
+		/* keep the current block for the small stuff */
+		if((block = arena_block_new(size)) == NULL) {
+			return(NULL);
+		}
+		block->used = size;
+		if(arena->blocks) {
+			block->next = arena->blocks->next;
+			arena->blocks->next = block;
+		} else {
+			arena->blocks = block;
+		}
+		return(block->data);
+	}
+
+	if((block = arena_block_new(ARENA_BLOCKSIZE)) == NULL) {
+		return(NULL);
+	}
+	block->next = arena->blocks;
+	block->used = size;
+	arena->blocks = block;
+	return(block->data);
+}
+
+/** Allocate zeroed memory suitably aligned for any type. */
+void *_alam_arena_alloc(amarena_t *arena, size_t size)
+{
+	void *ptr = arena_take(arena, size, sizeof(((struct arena_block *)0)->data[0]));
+	if(ptr) {
+		memset(ptr, 0, size);
+	}
+	return(ptr);
+}
+
+/** Copy a string into the arena. NULL stays NULL. */
+char *_alam_arena_strdup(amarena_t *arena, const char *str)
+{
+	size_t len;
+	char *copy;
+
+	if(str == NULL) {
+		return(NULL);
+	}
+	len = strlen(str) + 1;
+	if((copy = arena_take(arena, len, 1)) == NULL) {
+		return(NULL);
+	}
+	memcpy(copy, str, len);
+	return(copy);
+}
+
+/* FNV-1a */
+static size_t intern_hash(const char *str)
+{
+	size_t hash = 2166136261u;
+
+	for(; *str; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 16777619u;
+	}
+	return(hash);
+}
+
+static int intern_grow(amarena_t *arena)
+{
+	size_t slots = arena->slots ? arena->slots * 2 : ARENA_INTERN_SLOTS;
+	char **table;
+	size_t i;
+
+	CALLOC(table, slots, sizeof(char *), RET_ERR(AM_ERR_MEMORY, -1));
+	for(i = 0; i < arena->slots; i++) {
+		char *str = arena->intern[i];
+		if(str) {
+			size_t pos = intern_hash(str) & (slots - 1);
+			while(table[pos]) {
+				pos = (pos + 1) & (slots - 1);
+			}
+			table[pos] = str;
+		}
+	}
+	free(arena->intern);
+	arena->intern = table;
+	arena->slots = slots;
+	return(0);
+}
+
+/** Copy a string into the arena, sharing the copy with every other
+ * interned string that is equal to it. Meant for strings that repeat
+ * all over a db, like dependencies, licenses, archs or packagers.
+ * NULL stays NULL. */
+char *_alam_arena_intern(amarena_t *arena, const char *str)
+{
+	size_t pos;
+
+	if(str == NULL) {
+		return(NULL);
+	}
+	/* keep the table at most half full */
+	if(arena->count * 2 >= arena->slots && intern_grow(arena) != 0) {
+		return(NULL);
+	}
+
+	pos = intern_hash(str) & (arena->slots - 1);
+	while(arena->intern[pos]) {
+		if(strcmp(arena->intern[pos], str) == 0) {
+			return(arena->intern[pos]);
+		}
+		pos = (pos + 1) & (arena->slots - 1);
+	}
+
+	if((arena->intern[pos] = _alam_arena_strdup(arena, str)) == NULL) {
+		return(NULL);
+	}
+	arena->count++;
+	return(arena->intern[pos]);
+}
+
+/* vim: set ts=2 sw=2 noet: */
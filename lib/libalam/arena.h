@@ -0,0 +1,37 @@
+/*
+ *  arena.h
+ *
+ *  Copyright (c) 2006-2009 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ALAM_ARENA_H
+#define _ALAM_ARENA_H
+
+#include <sys/types.h>
+
+/* Bump allocator for data that lives as long as a db's package cache.
+ * Nothing allocated from it is freed on its own, the whole arena goes at
+ * once with _alam_arena_free(). */
+typedef struct _amarena_t amarena_t;
+
+amarena_t *_alam_arena_new(void);
+void _alam_arena_free(amarena_t *arena);
+void *_alam_arena_alloc(amarena_t *arena, size_t size);
+char *_alam_arena_strdup(amarena_t *arena, const char *str);
+char *_alam_arena_intern(amarena_t *arena, const char *str);
+
+#endif /* _ALAM_ARENA_H */
+
+/* vim: set ts=2 sw=2 noet: */
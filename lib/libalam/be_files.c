@@ -232,6 +232,7 @@ int SYMEXPORT alam_db_update(int force, amdb_t *db)
 
 		/* Cache needs to be rebuilt */
 		_alam_db_free_pkgcache(db);
+		db->pkgcache_failed = 0;
 
 		/* form the path to the db location */
 		len = strlen(dbpath) + strlen(db->treename) + strlen(DBEXT) + 1;
@@ -259,6 +260,22 @@ int SYMEXPORT alam_db_update(int force, amdb_t *db)
 	return(0);
 }
 
+/* Copy a string for a field of a db package. Packages in the pkgcache keep
+ * their strings in the db's arena, where those repeating all over the db
+ * are shared. */
+static char *pkgdup(ampkg_t *pkg, const char *str, int intern)
+{
+	if(pkg->arena == NULL) {
+		return(strdup(str));
+	} else if(intern) {
+		return(_alam_arena_intern(pkg->arena, str));
+	}
+	return(_alam_arena_strdup(pkg->arena, str));
+}
+
+/* like STRDUP(), using pkgdup() */
+#define PKGDUP(r, pkg, s, intern, action) do { r = pkgdup(pkg, s, intern); \
+	if(r == NULL) { ALLOC_FAIL(strlen(s)); action; } } while(0)
 
 static int splitname(const char *target, ampkg_t *pkg)
 {
@@ -284,16 +301,17 @@ static int splitname(const char *target, ampkg_t *pkg)
 	}
 
 	/* copy into fields and return */
-	if(pkg->version) {
+	if(pkg->version && !pkg->arena) {
 		FREE(pkg->version);
 	}
-	STRDUP(pkg->version, p+1, RET_ERR(AM_ERR_MEMORY, -1));
+	PKGDUP(pkg->version, pkg, p+1, 0, RET_ERR(AM_ERR_MEMORY, -1));
 	/* insert a terminator at the end of the name (on hyphen)- then copy it */
 	*p = '\0';
-	if(pkg->name) {
+	if(pkg->name && !pkg->arena) {
 		FREE(pkg->name);
 	}
-	STRDUP(pkg->name, tmp, RET_ERR(AM_ERR_MEMORY, -1));
+	/* names come back in the dependencies of other packages */
+	PKGDUP(pkg->name, pkg, tmp, 1, RET_ERR(AM_ERR_MEMORY, -1));
 
 	free(tmp);
 	return(0);
@@ -315,6 +333,10 @@ int _alam_db_populate(amdb_t *db)
 	if(dbdir == NULL) {
 		return(0);
 	}
+	if(db->arena == NULL && (db->arena = _alam_arena_new()) == NULL) {
+		closedir(dbdir);
+		return(-1);
+	}
 	while((ent = readdir(dbdir)) != NULL) {
 		const char *name = ent->d_name;
 		ampkg_t *pkg;
@@ -333,6 +355,7 @@ int _alam_db_populate(amdb_t *db)
 			closedir(dbdir);
 			return(-1);
 		}
+		pkg->arena = db->arena;
 		/* split the db entry name */
 		if(splitname(name, pkg) != 0) {
 			_alam_log(AM_LOG_ERROR, _("invalid name for database entry '%s'\n"),
@@ -352,12 +375,15 @@ int _alam_db_populate(amdb_t *db)
 		/* add to the collection */
 		_alam_log(AM_LOG_FUNCTION, "adding '%s' to package cache for db '%s'\n",
 				pkg->name, db->treename);
-		db->pkgcache = alam_list_add(db->pkgcache, pkg);
+		if(_alam_db_pkgcache_push(db, pkg) != 0) {
+			_alam_pkg_free(pkg);
+			closedir(dbdir);
+			return(-1);
+		}
 		count++;
 	}
 
 	closedir(dbdir);
-	db->pkgcache = alam_list_msort(db->pkgcache, count, _alam_pkg_cmp);
 	return(count);
 }
 
@@ -452,34 +478,34 @@ int _alam_db_read(amdb_t *db, ampkg_t *info, amdbinfrq_t inforeq)
 				if(fgets(line, 512, fp) == NULL) {
 					goto error;
 				}
-				STRDUP(info->filename, _alam_strtrim(line), goto error);
+				PKGDUP(info->filename, info, _alam_strtrim(line), 0, goto error);
 			} else if(strcmp(line, "%DESC%") == 0) {
 				if(fgets(line, 512, fp) == NULL) {
 					goto error;
 				}
-				STRDUP(info->desc, _alam_strtrim(line), goto error);
+				PKGDUP(info->desc, info, _alam_strtrim(line), 0, goto error);
 			} else if(strcmp(line, "%GROUPS%") == 0) {
 				while(fgets(line, 512, fp) && strlen(_alam_strtrim(line))) {
 					char *linedup;
-					STRDUP(linedup, _alam_strtrim(line), goto error);
+					PKGDUP(linedup, info, _alam_strtrim(line), 1, goto error);
 					info->groups = alam_list_add(info->groups, linedup);
 				}
 			} else if(strcmp(line, "%URL%") == 0) {
 				if(fgets(line, 512, fp) == NULL) {
 					goto error;
 				}
-				STRDUP(info->url, _alam_strtrim(line), goto error);
+				PKGDUP(info->url, info, _alam_strtrim(line), 0, goto error);
 			} else if(strcmp(line, "%LICENSE%") == 0) {
 				while(fgets(line, 512, fp) && strlen(_alam_strtrim(line))) {
 					char *linedup;
-					STRDUP(linedup, _alam_strtrim(line), goto error);
+					PKGDUP(linedup, info, _alam_strtrim(line), 1, goto error);
 					info->licenses = alam_list_add(info->licenses, linedup);
 				}
 			} else if(strcmp(line, "%ARCH%") == 0) {
 				if(fgets(line, 512, fp) == NULL) {
 					goto error;
 				}
-				STRDUP(info->arch, _alam_strtrim(line), goto error);
+				PKGDUP(info->arch, info, _alam_strtrim(line), 1, goto error);
 			} else if(strcmp(line, "%BUILDDATE%") == 0) {
 				if(fgets(line, 512, fp) == NULL) {
 					goto error;
@@ -516,7 +542,7 @@ int _alam_db_read(amdb_t *db, ampkg_t *info, amdbinfrq_t inforeq)
 				if(fgets(line, 512, fp) == NULL) {
 					goto error;
 				}
-				STRDUP(info->packager, _alam_strtrim(line), goto error);
+				PKGDUP(info->packager, info, _alam_strtrim(line), 1, goto error);
 			} else if(strcmp(line, "%REASON%") == 0) {
 				if(fgets(line, 512, fp) == NULL) {
 					goto error;
@@ -549,11 +575,18 @@ int _alam_db_read(amdb_t *db, ampkg_t *info, amdbinfrq_t inforeq)
 				if(fgets(line, 512, fp) == NULL) {
 					goto error;
 				}
-				STRDUP(info->md5sum, _alam_strtrim(line), goto error);
+				PKGDUP(info->md5sum, info, _alam_strtrim(line), 0, goto error);
+			} else if(strcmp(line, "%SHA256SUM%") == 0) {
+				/* SHA256SUM tag only appears in sync repositories,
+				 * not the local one. */
+				if(fgets(line, 512, fp) == NULL) {
+					goto error;
+				}
+				PKGDUP(info->sha256sum, info, _alam_strtrim(line), 0, goto error);
 			} else if(strcmp(line, "%REPLACES%") == 0) {
 				while(fgets(line, 512, fp) && strlen(_alam_strtrim(line))) {
 					char *linedup;
-					STRDUP(linedup, _alam_strtrim(line), goto error);
+					PKGDUP(linedup, info, _alam_strtrim(line), 1, goto error);
 					info->replaces = alam_list_add(info->replaces, linedup);
 				}
 			} else if(strcmp(line, "%FORCE%") == 0) {
@@ -576,13 +609,15 @@ int _alam_db_read(amdb_t *db, ampkg_t *info, amdbinfrq_t inforeq)
 			if(strcmp(line, "%FILES%") == 0) {
 				while(fgets(line, 512, fp) && strlen(_alam_strtrim(line))) {
 					char *linedup;
-					STRDUP(linedup, _alam_strtrim(line), goto error);
+					size_t len = strlen(_alam_strtrim(line));
+					/* directories are in the file lists of many packages */
+					PKGDUP(linedup, info, line, line[len - 1] == '/', goto error);
 					info->files = alam_list_add(info->files, linedup);
 				}
 			} else if(strcmp(line, "%BACKUP%") == 0) {
 				while(fgets(line, 512, fp) && strlen(_alam_strtrim(line))) {
 					char *linedup;
-					STRDUP(linedup, _alam_strtrim(line), goto error);
+					PKGDUP(linedup, info, _alam_strtrim(line), 0, goto error);
 					info->backup = alam_list_add(info->backup, linedup);
 				}
 			}
@@ -603,25 +638,30 @@ int _alam_db_read(amdb_t *db, ampkg_t *info, amdbinfrq_t inforeq)
 			_alam_strtrim(line);
 			if(strcmp(line, "%DEPENDS%") == 0) {
 				while(fgets(line, 512, fp) && strlen(_alam_strtrim(line))) {
-					amdepend_t *dep = _alam_splitdep(_alam_strtrim(line));
+					amdepend_t *dep;
+					if(info->arena) {
+						dep = _alam_splitdep_arena(info->arena, _alam_strtrim(line));
+					} else {
+						dep = _alam_splitdep(_alam_strtrim(line));
+					}
 					info->depends = alam_list_add(info->depends, dep);
 				}
 			} else if(strcmp(line, "%OPTDEPENDS%") == 0) {
 				while(fgets(line, 512, fp) && strlen(_alam_strtrim(line))) {
 					char *linedup;
-					STRDUP(linedup, _alam_strtrim(line), goto error);
+					PKGDUP(linedup, info, _alam_strtrim(line), 1, goto error);
 					info->optdepends = alam_list_add(info->optdepends, linedup);
 				}
 			} else if(strcmp(line, "%CONFLICTS%") == 0) {
 				while(fgets(line, 512, fp) && strlen(_alam_strtrim(line))) {
 					char *linedup;
-					STRDUP(linedup, _alam_strtrim(line), goto error);
+					PKGDUP(linedup, info, _alam_strtrim(line), 1, goto error);
 					info->conflicts = alam_list_add(info->conflicts, linedup);
 				}
 			} else if(strcmp(line, "%PROVIDES%") == 0) {
 				while(fgets(line, 512, fp) && strlen(_alam_strtrim(line))) {
 					char *linedup;
-					STRDUP(linedup, _alam_strtrim(line), goto error);
+					PKGDUP(linedup, info, _alam_strtrim(line), 1, goto error);
 					info->provides = alam_list_add(info->provides, linedup);
 				}
 			}
@@ -673,6 +713,28 @@ error:
 	return(-1);
 }
 
+/* Tells whether the db holds the file list of a package. Sync dbs only
+ * have it when the repo was built with one. */
+int _alam_db_has_files(amdb_t *db, ampkg_t *info)
+{
+	char *pkgpath;
+	char path[PATH_MAX];
+
+	if(db == NULL || info == NULL || info->name == NULL || info->version == NULL) {
+		return(0);
+	}
+	if(info->infolevel & INFRQ_FILES) {
+		return(1);
+	}
+	pkgpath = get_pkgpath(db, info);
+	if(pkgpath == NULL) {
+		return(0);
+	}
+	snprintf(path, PATH_MAX, "%sfiles", pkgpath);
+	free(pkgpath);
+	return(access(path, R_OK) == 0);
+}
+
 int _alam_db_prepare(amdb_t *db, ampkg_t *info)
 {
 	mode_t oldmask;
@@ -805,6 +867,10 @@ int _alam_db_write(amdb_t *db, ampkg_t *info, amdbinfrq_t inforeq)
 				fprintf(fp, "%%MD5SUM%%\n"
 								"%s\n\n", info->md5sum);
 			}
+			if(info->sha256sum) {
+				fprintf(fp, "%%SHA256SUM%%\n"
+								"%s\n\n", info->sha256sum);
+			}
 		}
 		fclose(fp);
 		fp = NULL;
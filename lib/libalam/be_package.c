@@ -25,7 +25,9 @@
 #include <string.h>
 #include <limits.h>
 #include <ctype.h>
+#include <unistd.h>
 #include <locale.h> /* setlocale */
+#include <sys/statvfs.h>
 
 /* libarchive */
 #include <archive.h>
@@ -37,6 +39,7 @@
 #include "log.h"
 #include "package.h"
 #include "deps.h" /* _alam_splitdep */
+#include "decompress.h"
 
 /**
  * Parses the package description file for a package into a ampkg_t struct.
@@ -48,6 +51,7 @@
 static int parse_descfile(struct archive *a, ampkg_t *newpkg)
 {
 	char line[PATH_MAX];
+	struct archive_read_buffer buf = ARCHIVE_READ_BUFFER_INIT;
 	char *ptr = NULL;
 	char *key = NULL;
 	int linenum = 0;
@@ -55,7 +59,7 @@ static int parse_descfile(struct archive *a, ampkg_t *newpkg)
 	ALAM_LOG_FUNC;
 
 	/* loop until we reach EOF (where archive_fgets will return NULL) */
-	while(_alam_archive_fgets(line, PATH_MAX, a) != NULL) {
+	while(_alam_archive_fgets(line, PATH_MAX, a, &buf) != NULL) {
 		linenum++;
 		_alam_strtrim(line);
 		if(strlen(line) == 0 || line[0] == '#') {
@@ -123,18 +127,117 @@ static int parse_descfile(struct archive *a, ampkg_t *newpkg)
 	return(0);
 }
 
+/* Decompressing is what makes a full read of xz, lzma and bzip2 packages
+ * slow; those are worth keeping in uncompressed form for the extraction. */
+static int spool_wanted(const char *pkgfile)
+{
+	switch(_alam_compression(pkgfile)) {
+		case AM_COMPRESSION_BZIP2:
+		case AM_COMPRESSION_LZMA:
+		case AM_COMPRESSION_XZ:
+			return(1);
+		default:
+			return(0);
+	}
+}
+
+/* Start writing the uncompressed copy of a package being loaded.
+ * spoolroom is what the copies of a transaction may still take. */
+static struct archive *spool_open(const char *pkgfile, const char *spooldir,
+		off_t *spoolroom, ampkg_t *newpkg)
+{
+	struct archive *writer;
+	struct statvfs fs;
+	const char *base = strrchr(pkgfile, '/');
+	size_t len;
+
+	base = base ? base + 1 : pkgfile;
+
+	/* the copy is about as large as the installed size */
+	if(newpkg->isize > *spoolroom) {
+		_alam_log(AM_LOG_DEBUG, "no room left to spool %s\n", pkgfile);
+		return(NULL);
+	}
+	if(statvfs(spooldir, &fs) != 0
+			|| (uintmax_t)fs.f_bavail * fs.f_frsize < (uintmax_t)newpkg->isize * 2) {
+		return(NULL);
+	}
+
+	/* spooldir + base + '.tar' + null */
+	len = strlen(spooldir) + strlen(base) + 5;
+	MALLOC(newpkg->spool, len, return(NULL));
+	snprintf(newpkg->spool, len, "%s%s.tar", spooldir, base);
+
+	if((writer = archive_write_new()) == NULL) {
+		FREE(newpkg->spool);
+		return(NULL);
+	}
+	archive_write_set_format_pax_restricted(writer);
+	if(archive_write_open_filename(writer, newpkg->spool) != ARCHIVE_OK) {
+		archive_write_finish(writer);
+		FREE(newpkg->spool);
+		return(NULL);
+	}
+	_alam_log(AM_LOG_DEBUG, "spooling %s to %s\n", pkgfile, newpkg->spool);
+	return(writer);
+}
+
+/* Copy an entry to the spool instead of skipping over it.
+ * Returns -1 on read errors, 1 if only the spool failed or outgrew the
+ * room left for it. */
+static int spool_entry(struct archive *archive, struct archive_entry *entry,
+		struct archive *writer, off_t spoolroom)
+{
+	char buf[65536];
+	ssize_t nread;
+
+	if(archive_write_header(writer, entry) != ARCHIVE_OK) {
+		return(archive_read_data_skip(archive) == ARCHIVE_OK ? 1 : -1);
+	}
+	while((nread = archive_read_data(archive, buf, sizeof(buf))) > 0) {
+		if(archive_write_data(writer, buf, nread) != nread
+				|| archive_position_uncompressed(writer) > spoolroom) {
+			return(archive_read_data_skip(archive) == ARCHIVE_OK ? 1 : -1);
+		}
+	}
+	return(nread < 0 ? -1 : 0);
+}
+
+static void spool_close(struct archive *writer, off_t *spoolroom,
+		ampkg_t *newpkg, int ok)
+{
+	struct stat st;
+
+	if(archive_write_close(writer) != ARCHIVE_OK) {
+		ok = 0;
+	}
+	archive_write_finish(writer);
+	if(ok && stat(newpkg->spool, &st) == 0 && st.st_size <= *spoolroom) {
+		*spoolroom -= st.st_size;
+	} else {
+		unlink(newpkg->spool);
+		FREE(newpkg->spool);
+	}
+}
+
 /**
  * Load a package and create the corresponding ampkg_t struct.
  * @param pkgfile path to the package file
  * @param full whether to stop the load after metadata is read or continue
  *             through the full archive
+ * @param spooldir where to keep an uncompressed copy of the package for
+ *             the extraction, or NULL
+ * @param spoolroom bytes the copies may still take in spooldir
  * @return An information filled ampkg_t struct
  */
-static ampkg_t *pkg_load(const char *pkgfile, unsigned short full)
+static ampkg_t *pkg_load(const char *pkgfile, unsigned short full,
+		const char *spooldir, off_t *spoolroom)
 {
 	int ret = ARCHIVE_OK;
 	int config = 0;
 	struct archive *archive;
+	struct archive *spool = NULL;
+	int spoolok = 1;
 	struct archive_entry *entry;
 	ampkg_t *newpkg = NULL;
 	struct stat st;
@@ -149,16 +252,8 @@ static ampkg_t *pkg_load(const char *pkgfile, unsigned short full)
 		RET_ERR(AM_ERR_PKG_OPEN, NULL);
 	}
 
-	if((archive = archive_read_new()) == NULL) {
-		RET_ERR(AM_ERR_LIBARCHIVE, NULL);
-	}
-
-	archive_read_support_compression_all(archive);
-	archive_read_support_format_all(archive);
-
-	if (archive_read_open_filename(archive, pkgfile,
-				ARCHIVE_DEFAULT_BYTES_PER_BLOCK) != ARCHIVE_OK) {
-		RET_ERR(AM_ERR_PKG_OPEN, NULL);
+	if((archive = _alam_archive_open(pkgfile, NULL)) == NULL) {
+		return(NULL);
 	}
 
 	newpkg = _alam_pkg_new();
@@ -176,6 +271,12 @@ static ampkg_t *pkg_load(const char *pkgfile, unsigned short full)
 	while((ret = archive_read_next_header(archive, &entry)) == ARCHIVE_OK) {
 		const char *entry_name = archive_entry_pathname(entry);
 
+		/* all metadata entries come first and start with a '.', stop at the
+		 * first real file if we are not doing a full read */
+		if(!full && config && *entry_name != '.') {
+			break;
+		}
+
 		if(strcmp(entry_name, ".PKGINFO") == 0) {
 			/* parse the info file */
 			if(parse_descfile(archive, newpkg) != 0) {
@@ -203,17 +304,36 @@ static ampkg_t *pkg_load(const char *pkgfile, unsigned short full)
 			newpkg->files = alam_list_add(newpkg->files, strdup(entry_name));
 		}
 
-		if(archive_read_data_skip(archive)) {
+		/* the full read decompresses every entry anyway, so keep the result
+		 * around if that was expensive. The spool is only opened once
+		 * .PKGINFO is read and would miss an entry coming before it, the
+		 * package is then extracted from its file. */
+		if(!config) {
+			spoolok = 0;
+		}
+		if(full && spooldir && config && spool == NULL && spoolok) {
+			if(spool_wanted(pkgfile)) {
+				spool = spool_open(pkgfile, spooldir, spoolroom, newpkg);
+			}
+			spoolok = (spool != NULL);
+		}
+
+		if(spool && spoolok) {
+			int r = spool_entry(archive, entry, spool, *spoolroom);
+			if(r == 1) {
+				spoolok = 0;
+			} else if(r == -1) {
+				_alam_log(AM_LOG_ERROR, _("error while reading package %s: %s\n"),
+						pkgfile, archive_error_string(archive));
+				am_errno = AM_ERR_LIBARCHIVE;
+				goto error;
+			}
+		} else if(archive_read_data_skip(archive)) {
 			_alam_log(AM_LOG_ERROR, _("error while reading package %s: %s\n"),
 					pkgfile, archive_error_string(archive));
 			am_errno = AM_ERR_LIBARCHIVE;
 			goto error;
 		}
-
-		/* if we are not doing a full read, see if we have all we need */
-		if(!full && config) {
-			break;
-		}
 	}
 
 	if(ret != ARCHIVE_EOF && ret != ARCHIVE_OK) { /* An error occured */
@@ -229,6 +349,10 @@ static ampkg_t *pkg_load(const char *pkgfile, unsigned short full)
 	}
 
   archive_read_finish(archive);
+	if(spool) {
+		spool_close(spool, spoolroom, newpkg, spoolok);
+		spool = NULL;
+	}
 
 	/* internal fields for package struct */
 	newpkg->origin = PKG_FROM_FILE;
@@ -251,6 +375,9 @@ static ampkg_t *pkg_load(const char *pkgfile, unsigned short full)
 pkg_invalid:
 	am_errno = AM_ERR_PKG_INVALID;
 error:
+	if(spool) {
+		spool_close(spool, spoolroom, newpkg, 0);
+	}
 	_alam_pkg_free(newpkg);
 	archive_read_finish(archive);
 
@@ -277,7 +404,7 @@ int SYMEXPORT alam_pkg_load(const char *filename, unsigned short full,
 			RET_ERR(AM_ERR_WRONG_ARGS, -1));
 	ASSERT(pkg != NULL, RET_ERR(AM_ERR_WRONG_ARGS, -1));
 
-	*pkg = pkg_load(filename, full);
+	*pkg = pkg_load(filename, full, NULL, NULL);
 	if(*pkg == NULL) {
 		/* am_errno is set by pkg_load */
 		return(-1);
@@ -286,4 +413,34 @@ int SYMEXPORT alam_pkg_load(const char *filename, unsigned short full,
 	return(0);
 }
 
+/** Fully load a package, keeping an uncompressed copy of it in spooldir
+ * when decompressing it is expensive. The copy is then used instead of
+ * the package file by commit_single_pkg(), so the package is only
+ * decompressed once.
+ * @param filename location of the package tarball
+ * @param spooldir directory for the copy, with a trailing slash
+ * @param spoolroom bytes all the copies in spooldir may still take; the
+ *             package is loaded without a copy once they are used up
+ * @param pkg address of the package pointer
+ * @return 0 on success, -1 on error (am_errno is set accordingly)
+ */
+int _alam_pkg_load_spooled(const char *filename, const char *spooldir,
+		off_t *spoolroom, ampkg_t **pkg)
+{
+	ALAM_LOG_FUNC;
+
+	ASSERT(filename != NULL && strlen(filename) != 0,
+			RET_ERR(AM_ERR_WRONG_ARGS, -1));
+	ASSERT(spooldir != NULL && spoolroom != NULL,
+			RET_ERR(AM_ERR_WRONG_ARGS, -1));
+	ASSERT(pkg != NULL, RET_ERR(AM_ERR_WRONG_ARGS, -1));
+
+	*pkg = pkg_load(filename, 1, spooldir, spoolroom);
+	if(*pkg == NULL) {
+		return(-1);
+	}
+
+	return(0);
+}
+
 /* vim: set ts=2 sw=2 noet: */
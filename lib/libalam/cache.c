@@ -34,6 +34,116 @@
 #include "package.h"
 #include "group.h"
 #include "db.h"
+#include "repoindex.h"
+
+/* The packages of a db are kept in db->pkgvec, sorted by name. The
+ * db->pkgcache list is a view of it, with all nodes in one block, and is
+ * rebuilt by the first _alam_db_get_pkgcache() after the vector changed.
+ * The views handed out before, and the packages removed since, are kept
+ * until the cache is freed, so a caller can go on walking its list while
+ * packages are added or removed. */
+
+static int pkgvec_cmp(const void *p1, const void *p2)
+{
+	const ampkg_t *pkg1 = *(ampkg_t * const *)p1;
+	const ampkg_t *pkg2 = *(ampkg_t * const *)p2;
+	return(strcmp(pkg1->name, pkg2->name));
+}
+
+/* Binary search for name; returns its index, or the index it would be
+ * inserted at, with found set accordingly. */
+static size_t pkgvec_search(amdb_t *db, const char *name, int *found)
+{
+	size_t lo = 0, hi = db->pkgcount;
+
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(db->pkgvec[mid]->name, name);
+		if(cmp == 0) {
+			*found = 1;
+			return(mid);
+		} else if(cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	*found = 0;
+	return(lo);
+}
+
+static int pkgvec_reserve(amdb_t *db, size_t count)
+{
+	ampkg_t **vec;
+	size_t size;
+
+	if(count <= db->pkgvecsize) {
+		return(0);
+	}
+	size = db->pkgvecsize ? db->pkgvecsize * 2 : 256;
+	while(size < count) {
+		size *= 2;
+	}
+	if((vec = realloc(db->pkgvec, size * sizeof(ampkg_t *))) == NULL) {
+		ALLOC_FAIL(size * sizeof(ampkg_t *));
+		RET_ERR(AM_ERR_MEMORY, -1);
+	}
+	db->pkgvec = vec;
+	db->pkgvecsize = size;
+	return(0);
+}
+
+static int pkgcache_view(amdb_t *db)
+{
+	alam_list_t *nodes = NULL;
+	size_t i, count = db->pkgcount;
+
+	if(count > 0) {
+		CALLOC(nodes, count, sizeof(alam_list_t), RET_ERR(AM_ERR_MEMORY, -1));
+	}
+	for(i = 0; i < count; i++) {
+		nodes[i].data = db->pkgvec[i];
+		nodes[i].next = (i + 1 < count) ? &nodes[i + 1] : NULL;
+		/* the head points back to the tail */
+		nodes[i].prev = i ? &nodes[i - 1] : &nodes[count - 1];
+	}
+	if(db->pkgcache) {
+		db->pkgcache_retired = alam_list_add(db->pkgcache_retired, db->pkgcache);
+	}
+	db->pkgcache = nodes;
+	db->pkgcache_stale = 0;
+	return(0);
+}
+
+static void pkgcache_clear(amdb_t *db)
+{
+	size_t i;
+
+	for(i = 0; i < db->pkgcount; i++) {
+		_alam_pkg_free(db->pkgvec[i]);
+	}
+	FREE(db->pkgvec);
+	db->pkgcount = db->pkgvecsize = 0;
+	FREE(db->pkgcache);
+	FREELIST(db->pkgcache_retired);
+	alam_list_free_inner(db->pkgs_removed, (alam_list_fn_free)_alam_pkg_free);
+	alam_list_free(db->pkgs_removed);
+	db->pkgs_removed = NULL;
+	db->pkgcache_stale = 0;
+}
+
+/** Add a package to the cache while it is populated. The cache is sorted
+ * once at the end by _alam_db_load_pkgcache().
+ * @return 0 on success, -1 on error
+ */
+int _alam_db_pkgcache_push(amdb_t *db, ampkg_t *pkg)
+{
+	if(pkgvec_reserve(db, db->pkgcount + 1) != 0) {
+		return(-1);
+	}
+	db->pkgvec[db->pkgcount++] = pkg;
+	return(0);
+}
 
 /* Returns a new package cache from db.
  * It frees the cache if it already exists.
@@ -52,10 +162,21 @@ int _alam_db_load_pkgcache(amdb_t *db)
 	if(_alam_db_populate(db) == -1) {
 		_alam_log(AM_LOG_DEBUG,
 				"failed to load package cache for repository '%s'\n", db->treename);
+		pkgcache_clear(db);
+		db->pkgcache_failed = 1;
+		return(-1);
+	}
+
+	qsort(db->pkgvec, db->pkgcount, sizeof(ampkg_t *), pkgvec_cmp);
+	if(pkgcache_view(db) != 0) {
+		pkgcache_clear(db);
+		db->pkgcache_failed = 1;
 		return(-1);
 	}
 
 	db->pkgcache_loaded = 1;
+	db->pkgcache_failed = 0;
+	_alam_repoindex_invalidate(db);
 	return(0);
 }
 
@@ -70,12 +191,14 @@ void _alam_db_free_pkgcache(amdb_t *db)
 	_alam_log(AM_LOG_DEBUG, "freeing package cache for repository '%s'\n",
 	                        db->treename);
 
-	alam_list_free_inner(db->pkgcache, (alam_list_fn_free)_alam_pkg_free);
-	alam_list_free(db->pkgcache);
-	db->pkgcache = NULL;
+	_alam_repoindex_invalidate(db);
+	pkgcache_clear(db);
 	db->pkgcache_loaded = 0;
+	_alam_arena_free(db->arena);
+	db->arena = NULL;
 
 	_alam_db_free_grpcache(db);
+	_alam_db_free_replcache(db);
 }
 
 alam_list_t *_alam_db_get_pkgcache(amdb_t *db)
@@ -88,6 +211,8 @@ alam_list_t *_alam_db_get_pkgcache(amdb_t *db)
 
 	if(!db->pkgcache_loaded) {
 		_alam_db_load_pkgcache(db);
+	} else if(db->pkgcache_stale) {
+		pkgcache_view(db);
 	}
 
 	/* hmmm, still NULL ?*/
@@ -102,6 +227,8 @@ alam_list_t *_alam_db_get_pkgcache(amdb_t *db)
 int _alam_db_add_pkgincache(amdb_t *db, ampkg_t *pkg)
 {
 	ampkg_t *newpkg;
+	size_t pos;
+	int found;
 
 	ALAM_LOG_FUNC;
 
@@ -126,17 +253,29 @@ int _alam_db_add_pkgincache(amdb_t *db, ampkg_t *pkg)
 
 	_alam_log(AM_LOG_DEBUG, "adding entry '%s' in '%s' cache\n",
 						alam_pkg_get_name(newpkg), db->treename);
-	db->pkgcache = alam_list_add_sorted(db->pkgcache, newpkg, _alam_pkg_cmp);
+	if(pkgvec_reserve(db, db->pkgcount + 1) != 0) {
+		_alam_pkg_free(newpkg);
+		return(-1);
+	}
+	pos = pkgvec_search(db, newpkg->name, &found);
+	memmove(db->pkgvec + pos + 1, db->pkgvec + pos,
+			(db->pkgcount - pos) * sizeof(ampkg_t *));
+	db->pkgvec[pos] = newpkg;
+	db->pkgcount++;
+	db->pkgcache_stale = 1;
+	_alam_repoindex_invalidate(db);
 
 	_alam_db_free_grpcache(db);
+	_alam_db_free_replcache(db);
 
 	return(0);
 }
 
 int _alam_db_remove_pkgfromcache(amdb_t *db, ampkg_t *pkg)
 {
-	void *vdata;
 	ampkg_t *data;
+	size_t pos;
+	int found;
 
 	ALAM_LOG_FUNC;
 
@@ -147,18 +286,25 @@ int _alam_db_remove_pkgfromcache(amdb_t *db, ampkg_t *pkg)
 	_alam_log(AM_LOG_DEBUG, "removing entry '%s' from '%s' cache\n",
 						alam_pkg_get_name(pkg), db->treename);
 
-	db->pkgcache = alam_list_remove(db->pkgcache, pkg, _alam_pkg_cmp, &vdata);
-	data = vdata;
-	if(data == NULL) {
+	pos = pkgvec_search(db, alam_pkg_get_name(pkg), &found);
+	if(!found) {
 		/* package not found */
 		_alam_log(AM_LOG_DEBUG, "cannot remove entry '%s' from '%s' cache: not found\n",
 							alam_pkg_get_name(pkg), db->treename);
 		return(-1);
 	}
+	data = db->pkgvec[pos];
+	db->pkgcount--;
+	memmove(db->pkgvec + pos, db->pkgvec + pos + 1,
+			(db->pkgcount - pos) * sizeof(ampkg_t *));
+	db->pkgcache_stale = 1;
+	_alam_repoindex_invalidate(db);
 
-	_alam_pkg_free(data);
+	/* older views may still hold it */
+	db->pkgs_removed = alam_list_add(db->pkgs_removed, data);
 
 	_alam_db_free_grpcache(db);
+	_alam_db_free_replcache(db);
 
 	return(0);
 }
@@ -172,13 +318,17 @@ ampkg_t *_alam_db_get_pkgfromcache(amdb_t *db, const char *target)
 	}
 
 	alam_list_t *pkgcache = _alam_db_get_pkgcache(db);
-	if(!pkgcache) {
+	size_t pos;
+	int found;
+
+	if(!pkgcache || target == NULL) {
 		_alam_log(AM_LOG_DEBUG, "warning: failed to get '%s' from NULL pkgcache\n",
 				target);
 		return(NULL);
 	}
 
-	return(_alam_pkg_find(pkgcache, target));
+	pos = pkgvec_search(db, target, &found);
+	return(found ? db->pkgvec[pos] : NULL);
 }
 
 /* Returns a new group cache from db.
@@ -288,4 +438,115 @@ amgrp_t *_alam_db_get_grpfromcache(amdb_t *db, const char *target)
 	return(NULL);
 }
 
+static int replacer_cmp(const void *p1, const void *p2)
+{
+	const amreplacer_t *r1 = p1;
+	const amreplacer_t *r2 = p2;
+	int cmp = strcmp(r1->name, r2->name);
+	if(cmp == 0) {
+		cmp = strcmp(r1->pkg->name, r2->pkg->name);
+	}
+	return(cmp);
+}
+
+/* Builds the replaces index of db, mapping each replaced name to the
+ * packages replacing it.
+ */
+int _alam_db_load_replcache(amdb_t *db)
+{
+	alam_list_t *i, *j;
+	size_t count = 0, n;
+
+	ALAM_LOG_FUNC;
+
+	if(db == NULL) {
+		return(-1);
+	}
+	_alam_db_free_replcache(db);
+
+	_alam_log(AM_LOG_DEBUG, "loading replaces cache for repository '%s'\n",
+	                        db->treename);
+
+	for(i = _alam_db_get_pkgcache(db); i; i = i->next) {
+		count += alam_list_count(alam_pkg_get_replaces(i->data));
+	}
+
+	if(count) {
+		CALLOC(db->replcache, count, sizeof(amreplacer_t),
+				RET_ERR(AM_ERR_MEMORY, -1));
+	}
+	for(i = _alam_db_get_pkgcache(db); i; i = i->next) {
+		ampkg_t *pkg = i->data;
+		for(j = alam_pkg_get_replaces(pkg); j; j = j->next) {
+			db->replcache[db->replcount].name = j->data;
+			db->replcache[db->replcount].pkg = pkg;
+			db->replcount++;
+		}
+	}
+	qsort(db->replcache, db->replcount, sizeof(amreplacer_t), replacer_cmp);
+
+	/* a package listing a name twice still replaces it once */
+	for(n = 0, count = 0; n < db->replcount; n++) {
+		if(count && replacer_cmp(&db->replcache[count - 1], &db->replcache[n]) == 0) {
+			continue;
+		}
+		db->replcache[count++] = db->replcache[n];
+	}
+	db->replcount = count;
+
+	db->replcache_loaded = 1;
+	return(0);
+}
+
+void _alam_db_free_replcache(amdb_t *db)
+{
+	ALAM_LOG_FUNC;
+
+	if(db == NULL || !db->replcache_loaded) {
+		return;
+	}
+
+	FREE(db->replcache);
+	db->replcount = 0;
+	db->replcache_loaded = 0;
+}
+
+/* Returns the packages of db replacing name, in the order of the package
+ * cache, and stores their number in count.
+ */
+amreplacer_t *_alam_db_get_replacers(amdb_t *db, const char *name,
+		size_t *count)
+{
+	size_t lo = 0, hi, first;
+
+	ALAM_LOG_FUNC;
+
+	*count = 0;
+	if(db == NULL || name == NULL) {
+		return(NULL);
+	}
+
+	if(!db->replcache_loaded) {
+		_alam_db_load_replcache(db);
+	}
+
+	/* lower bound of name */
+	hi = db->replcount;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if(strcmp(db->replcache[mid].name, name) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	first = lo;
+	while(lo < db->replcount && strcmp(db->replcache[lo].name, name) == 0) {
+		lo++;
+	}
+
+	*count = lo - first;
+	return(*count ? &db->replcache[first] : NULL);
+}
+
 /* vim: set ts=2 sw=2 noet: */
@@ -26,6 +26,7 @@
 
 /* packages */
 int _alam_db_load_pkgcache(amdb_t *db);
+int _alam_db_pkgcache_push(amdb_t *db, ampkg_t *pkg);
 void _alam_db_free_pkgcache(amdb_t *db);
 int _alam_db_add_pkgincache(amdb_t *db, ampkg_t *pkg);
 int _alam_db_remove_pkgfromcache(amdb_t *db, ampkg_t *pkg);
@@ -37,6 +38,11 @@ int _alam_db_load_grpcache(amdb_t *db);
 void _alam_db_free_grpcache(amdb_t *db);
 alam_list_t *_alam_db_get_grpcache(amdb_t *db);
 amgrp_t *_alam_db_get_grpfromcache(amdb_t *db, const char *target);
+/* replaces */
+int _alam_db_load_replcache(amdb_t *db);
+void _alam_db_free_replcache(amdb_t *db);
+amreplacer_t *_alam_db_get_replacers(amdb_t *db, const char *name,
+		size_t *count);
 
 #endif /* _ALAM_CACHE_H */
 
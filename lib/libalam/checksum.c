@@ -0,0 +1,349 @@
+/*
+ *  checksum.c
+ *
+ *  Copyright (c) 2006-2009 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h> /* intmax_t */
+#include <limits.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* libalam */
+#include "checksum.h"
+#include "alam_list.h"
+#include "util.h"
+#include "log.h"
+#include "handle.h"
+
+/* name of the memo, kept in the cachedir */
+#define CHECKSUM_MEMO ".verified"
+
+/* downloads, delta workers and checksum tests use the memo from several
+ * threads */
+static pthread_mutex_t checksum_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void _alam_checksum_free(amchecksum_t *sums)
+{
+	if(sums == NULL) {
+		return;
+	}
+	FREE(sums->path);
+	FREE(sums->md5sum);
+	FREE(sums->sha256sum);
+	FREE(sums);
+}
+
+static int checksum_cmp_path(const void *sums, const void *path)
+{
+	return(strcmp(((const amchecksum_t *)sums)->path, (const char *)path));
+}
+
+static amchecksum_t *checksum_find(const char *path)
+{
+	alam_list_t *i;
+
+	for(i = handle->checksums; i; i = i->next) {
+		amchecksum_t *sums = i->data;
+		if(strcmp(sums->path, path) == 0) {
+			return(sums);
+		}
+	}
+	return(NULL);
+}
+
+static int checksum_match(const amchecksum_t *sums, const struct stat *st)
+{
+	return(sums->dev == st->st_dev && sums->ino == st->st_ino
+			&& sums->size == st->st_size
+			&& sums->mtime.tv_sec == st->st_mtim.tv_sec
+			&& sums->mtime.tv_nsec == st->st_mtim.tv_nsec
+			&& sums->ctime.tv_sec == st->st_ctim.tv_sec
+			&& sums->ctime.tv_nsec == st->st_ctim.tv_nsec);
+}
+
+/* a checksum read from the memo: len hex digits, or '-' if unknown */
+static int checksum_valid(const char *sum, size_t len)
+{
+	size_t k;
+
+	if(strcmp(sum, "-") == 0) {
+		return(1);
+	}
+	for(k = 0; k < len; k++) {
+		if(!isxdigit((unsigned char)sum[k])) {
+			return(0);
+		}
+	}
+	return(sum[len] == '\0');
+}
+
+static char *get_memofile(void)
+{
+	const char *cachedir = _alam_filecache_setup();
+	char *file;
+	/* cachedir + memo name + NULL */
+	size_t len = strlen(cachedir) + strlen(CHECKSUM_MEMO) + 1;
+
+	MALLOC(file, len, RET_ERR(AM_ERR_MEMORY, NULL));
+	snprintf(file, len, "%s%s", cachedir, CHECKSUM_MEMO);
+	return(file);
+}
+
+/* Reads the memo once the db lock is held, so no other process can update
+ * it at the same time (see _alam_lckmk()). Entries recorded before that
+ * are newer than the ones on disk and are kept. */
+static void checksum_load(void)
+{
+	FILE *fp;
+	char *file;
+	char line[PATH_MAX + 256];
+	char md5sum[65], sha256sum[65];
+
+	if(handle->checksums_loaded || handle->lckfd == -1) {
+		return;
+	}
+	handle->checksums_loaded = 1;
+
+	file = get_memofile();
+	if(file == NULL || (fp = fopen(file, "r")) == NULL) {
+		FREE(file);
+		return;
+	}
+	while(fgets(line, sizeof(line), fp)) {
+		amchecksum_t *sums;
+		uintmax_t dev, ino;
+		intmax_t size, msec, csec;
+		long mnsec, cnsec;
+		char *path;
+		int pos = 0;
+
+		if(strchr(line, '\n') == NULL && !feof(fp)) {
+			/* drop the whole of an overlong line */
+			int c;
+			while((c = fgetc(fp)) != EOF && c != '\n');
+			continue;
+		}
+		if(sscanf(line, "%ju %ju %jd %jd.%ld %jd.%ld %64s %64s %n", &dev, &ino,
+					&size, &msec, &mnsec, &csec, &cnsec, md5sum, sha256sum,
+					&pos) != 9 || pos == 0
+				|| !checksum_valid(md5sum, 32) || !checksum_valid(sha256sum, 64)) {
+			continue;
+		}
+		path = _alam_strtrim(line + pos);
+		if(*path == '\0' || checksum_find(path) != NULL) {
+			continue;
+		}
+		CALLOC(sums, 1, sizeof(amchecksum_t), break);
+		sums->dev = (dev_t)dev;
+		sums->ino = (ino_t)ino;
+		sums->size = (off_t)size;
+		sums->mtime.tv_sec = (time_t)msec;
+		sums->mtime.tv_nsec = mnsec;
+		sums->ctime.tv_sec = (time_t)csec;
+		sums->ctime.tv_nsec = cnsec;
+		STRDUP(sums->path, path, _alam_checksum_free(sums); break);
+		if(*md5sum != '-') {
+			STRDUP(sums->md5sum, md5sum, _alam_checksum_free(sums); break);
+		}
+		if(*sha256sum != '-') {
+			STRDUP(sums->sha256sum, sha256sum, _alam_checksum_free(sums); break);
+		}
+		handle->checksums = alam_list_add(handle->checksums, sums);
+	}
+	fclose(fp);
+	FREE(file);
+}
+
+/* Read the memo now rather than on first use, for callers that are about
+ * to change the cachedirs. */
+void _alam_checksum_load(void)
+{
+	pthread_mutex_lock(&checksum_lock);
+	checksum_load();
+	pthread_mutex_unlock(&checksum_lock);
+}
+
+/** Record the checksums of a cached file.
+ * Files are hashed while they are downloaded or patched, and when their
+ * checksum is tested; the integrity check does not read them again.
+ * @param filepath the file
+ * @param st the file as it was hashed, NULL to stat it now
+ * @param md5sum its md5, NULL if not known
+ * @param sha256sum its sha256, NULL if not known
+ * @return 0 on success, -1 on error
+ */
+int _alam_checksum_store(const char *filepath, const struct stat *st,
+		const char *md5sum, const char *sha256sum)
+{
+	amchecksum_t *sums;
+	struct stat buf;
+	int ret = 0;
+
+	if(filepath == NULL || (md5sum == NULL && sha256sum == NULL)) {
+		return(-1);
+	}
+	if(st == NULL) {
+		if(stat(filepath, &buf) != 0) {
+			return(-1);
+		}
+		st = &buf;
+	}
+
+	pthread_mutex_lock(&checksum_lock);
+	checksum_load();
+	sums = checksum_find(filepath);
+	if(sums != NULL && !checksum_match(sums, st)) {
+		/* the entry of an older version of the same file */
+		handle->checksums = alam_list_remove(handle->checksums, filepath,
+				checksum_cmp_path, NULL);
+		_alam_checksum_free(sums);
+		sums = NULL;
+	}
+	if(sums == NULL) {
+		CALLOC(sums, 1, sizeof(amchecksum_t), ret = -1; goto cleanup);
+		STRDUP(sums->path, filepath, _alam_checksum_free(sums); ret = -1;
+				goto cleanup);
+		sums->dev = st->st_dev;
+		sums->ino = st->st_ino;
+		sums->size = st->st_size;
+		sums->mtime = st->st_mtim;
+		sums->ctime = st->st_ctim;
+		handle->checksums = alam_list_add(handle->checksums, sums);
+	}
+	if(md5sum != NULL) {
+		FREE(sums->md5sum);
+		STRDUP(sums->md5sum, md5sum, ret = -1);
+	}
+	if(sha256sum != NULL) {
+		FREE(sums->sha256sum);
+		STRDUP(sums->sha256sum, sha256sum, ret = -1);
+	}
+
+cleanup:
+	pthread_mutex_unlock(&checksum_lock);
+	return(ret);
+}
+
+/** Look up a checksum recorded by _alam_checksum_store().
+ * @param filepath the file
+ * @param type the checksum wanted
+ * @return the checksum, NULL if it is not known or the file changed since
+ */
+char *_alam_checksum_stored(const char *filepath, amhashtype_t type)
+{
+	amchecksum_t *sums;
+	struct stat st;
+	char *sum = NULL;
+
+	if(filepath == NULL || stat(filepath, &st) != 0) {
+		return(NULL);
+	}
+
+	pthread_mutex_lock(&checksum_lock);
+	checksum_load();
+	sums = checksum_find(filepath);
+	if(sums != NULL && checksum_match(sums, &st)) {
+		const char *known = type == AM_HASH_SHA256 ? sums->sha256sum : sums->md5sum;
+		STRDUP(sum, known, sum = NULL);
+	}
+	pthread_mutex_unlock(&checksum_lock);
+	return(sum);
+}
+
+/* Drop the checksums of a file that is removed or rewritten. */
+void _alam_checksum_forget(const char *filepath)
+{
+	void *data = NULL;
+
+	if(filepath == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&checksum_lock);
+	checksum_load();
+	handle->checksums = alam_list_remove(handle->checksums, filepath,
+			checksum_cmp_path, &data);
+	_alam_checksum_free(data);
+	pthread_mutex_unlock(&checksum_lock);
+}
+
+/** Write the memo back to the cachedir, dropping the entries of files
+ * that are gone or changed since they were hashed.
+ * Nothing is written unless the db lock is held.
+ * @return 0 on success, -1 on error
+ */
+int _alam_checksum_save(void)
+{
+	FILE *fp;
+	char *file = NULL, *tmpfile = NULL;
+	alam_list_t *i;
+	size_t len;
+	int ret = 0;
+
+	pthread_mutex_lock(&checksum_lock);
+	checksum_load();
+	if(!handle->checksums_loaded) {
+		goto cleanup;
+	}
+	if((file = get_memofile()) == NULL) {
+		ret = -1;
+		goto cleanup;
+	}
+	len = strlen(file) + 5;
+	MALLOC(tmpfile, len, ret = -1; goto cleanup);
+	snprintf(tmpfile, len, "%s.tmp", file);
+
+	if((fp = fopen(tmpfile, "w")) == NULL) {
+		_alam_log(AM_LOG_DEBUG, "could not write %s\n", tmpfile);
+		ret = -1;
+		goto cleanup;
+	}
+	for(i = handle->checksums; i; i = i->next) {
+		amchecksum_t *sums = i->data;
+		struct stat st;
+
+		if(stat(sums->path, &st) != 0 || !checksum_match(sums, &st)) {
+			continue;
+		}
+		if(fprintf(fp, "%ju %ju %jd %jd.%09ld %jd.%09ld %s %s %s\n",
+					(uintmax_t)sums->dev, (uintmax_t)sums->ino, (intmax_t)sums->size,
+					(intmax_t)sums->mtime.tv_sec, (long)sums->mtime.tv_nsec,
+					(intmax_t)sums->ctime.tv_sec, (long)sums->ctime.tv_nsec,
+					sums->md5sum ? sums->md5sum : "-",
+					sums->sha256sum ? sums->sha256sum : "-", sums->path) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	if(fclose(fp) != 0 || ret != 0 || rename(tmpfile, file) != 0) {
+		unlink(tmpfile);
+		ret = -1;
+	}
+
+cleanup:
+	pthread_mutex_unlock(&checksum_lock);
+	FREE(tmpfile);
+	FREE(file);
+	return(ret);
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,53 @@
+/*
+ *  checksum.h
+ *
+ *  Copyright (c) 2006-2009 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ALAM_CHECKSUM_H
+#define _ALAM_CHECKSUM_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "hash.h"
+
+/* Known checksums of a cached file, kept in cachedir/.verified between
+ * runs. An entry only stands for the exact inode it was taken from: any
+ * write, rename over or touch changes the key and the file is hashed
+ * again. */
+typedef struct _amchecksum_t {
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	char *md5sum;            /* NULL if not known */
+	char *sha256sum;         /* NULL if not known */
+} amchecksum_t;
+
+void _alam_checksum_free(amchecksum_t *sums);
+void _alam_checksum_load(void);
+int _alam_checksum_store(const char *filepath, const struct stat *st,
+		const char *md5sum, const char *sha256sum);
+char *_alam_checksum_stored(const char *filepath, amhashtype_t type);
+void _alam_checksum_forget(const char *filepath);
+int _alam_checksum_save(void);
+
+#endif /* _ALAM_CHECKSUM_H */
+
+/* vim: set ts=2 sw=2 noet: */
@@ -345,6 +345,7 @@ void _alam_db_free(amdb_t *db)
 
 	/* cleanup pkgcache */
 	_alam_db_free_pkgcache(db);
+	_alam_arena_free(db->arena);
 	/* cleanup server list */
 	FREELIST(db->servers);
 	FREE(db->path);
@@ -498,6 +499,7 @@ amdb_t *_alam_db_register_sync(const char *treename)
 		RET_ERR(AM_ERR_DB_CREATE, NULL);
 	}
 
+	db->rank = ++handle->dbranks;
 	handle->dbs_sync = alam_list_add(handle->dbs_sync, db);
 	return(db);
 }
@@ -20,6 +20,7 @@
 #define _ALAM_DB_H
 
 #include "alam.h"
+#include "arena.h"
 #include <limits.h>
 #include <time.h>
 
@@ -35,15 +36,33 @@ typedef enum _amdbinfrq_t {
 	INFRQ_ALL = 0x3F
 } amdbinfrq_t;
 
+/* An entry of the replaces index of a db: pkg replaces name */
+typedef struct _amreplacer_t {
+	const char *name;
+	ampkg_t *pkg;
+} amreplacer_t;
+
 /* Database */
 struct __amdb_t {
 	char *path;
 	char *treename;
 	unsigned short pkgcache_loaded;
-	alam_list_t *pkgcache;
+	unsigned short pkgcache_failed; /* not retried by the repo indexes */
+	alam_list_t *pkgcache; /* list view of pkgvec, see cache.c */
+	unsigned short pkgcache_stale; /* pkgvec changed since the view was built */
+	alam_list_t *pkgcache_retired; /* older views, kept until the cache is freed */
+	alam_list_t *pkgs_removed; /* packages removed from pkgvec, likewise */
+	ampkg_t **pkgvec; /* packages sorted by name */
+	size_t pkgcount;
+	size_t pkgvecsize;
 	unsigned short grpcache_loaded;
 	alam_list_t *grpcache;
+	unsigned short replcache_loaded;
+	amreplacer_t *replcache; /* sorted by name, then by replacer name */
+	size_t replcount;
 	alam_list_t *servers;
+	amarena_t *arena; /* strings of the packages in pkgcache */
+	unsigned int rank; /* sync db order, 0 for the local db */
 };
 
 /* db.c, database general calls */
@@ -57,6 +76,7 @@ amdb_t *_alam_db_register_sync(const char *treename);
 /* be.c, backend specific calls */
 int _alam_db_populate(amdb_t *db);
 int _alam_db_read(amdb_t *db, ampkg_t *info, amdbinfrq_t inforeq);
+int _alam_db_has_files(amdb_t *db, ampkg_t *info);
 int _alam_db_prepare(amdb_t *db, ampkg_t *info);
 int _alam_db_write(amdb_t *db, ampkg_t *info, amdbinfrq_t inforeq);
 int _alam_db_remove(amdb_t *db, ampkg_t *info);
@@ -0,0 +1,335 @@
+/*
+ *  decompress.c
+ *
+ *  Copyright (c) 2006-2009 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include <archive.h>
+
+#ifdef HAVE_LIBLZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+/* libalam */
+#include "decompress.h"
+#include "util.h"
+#include "log.h"
+#include "alam.h"
+
+/* size of the compressed and decompressed buffers of a decoder */
+#define DECODER_BUFSIZE (128 * 1024)
+/* error number reported to libarchive for bad data, its "misc" error */
+#define DECODER_ERRNO (-1)
+
+/** Guess the compression of a file from its first bytes.
+ * @param path the file to look at
+ * @return the compression, AM_COMPRESSION_NONE if unknown or unreadable
+ */
+amcompression_t _alam_compression(const char *path)
+{
+	unsigned char magic[6];
+	ssize_t len;
+	int fd;
+
+	if((fd = open(path, O_RDONLY)) == -1) {
+		return(AM_COMPRESSION_NONE);
+	}
+	len = read(fd, magic, sizeof(magic));
+	close(fd);
+
+	if(len >= 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0) {
+		return(AM_COMPRESSION_XZ);
+	} else if(len >= 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0) {
+		return(AM_COMPRESSION_ZSTD);
+	} else if(len >= 3 && memcmp(magic, "BZh", 3) == 0) {
+		return(AM_COMPRESSION_BZIP2);
+	} else if(len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+		return(AM_COMPRESSION_GZIP);
+	} else if(len >= 3 && magic[0] == 0x5d && magic[1] == 0 && magic[2] == 0) {
+		/* the legacy lzma format has no real magic, this is the header
+		 * written with the default settings */
+		return(AM_COMPRESSION_LZMA);
+	}
+	return(AM_COMPRESSION_NONE);
+}
+
+#if defined(HAVE_LIBLZMA) || defined(HAVE_LIBZSTD)
+
+/* A decoder run in front of libarchive for the formats where we can do
+ * better than libarchive's own filters. */
+struct decoder {
+	amcompression_t type;
+	int fd;
+	int ineof;
+	int64_t *rawpos;
+	size_t inpos;
+	size_t inlen;
+#ifdef HAVE_LIBLZMA
+	lzma_stream lzma;
+#endif
+#ifdef HAVE_LIBZSTD
+	ZSTD_DStream *zstd;
+#endif
+	unsigned char in[DECODER_BUFSIZE];
+	unsigned char out[DECODER_BUFSIZE];
+};
+
+static void decoder_free(struct decoder *dec)
+{
+#ifdef HAVE_LIBLZMA
+	if(dec->type == AM_COMPRESSION_XZ) {
+		lzma_end(&dec->lzma);
+	}
+#endif
+#ifdef HAVE_LIBZSTD
+	if(dec->zstd) {
+		ZSTD_freeDStream(dec->zstd);
+	}
+#endif
+	if(dec->fd != -1) {
+		close(dec->fd);
+	}
+	free(dec);
+}
+
+static struct decoder *decoder_new(const char *path, amcompression_t type)
+{
+	struct decoder *dec;
+
+	MALLOC(dec, sizeof(struct decoder), return(NULL));
+	dec->type = type;
+	dec->fd = -1;
+
+	switch(type) {
+#ifdef HAVE_LIBLZMA
+		case AM_COMPRESSION_XZ:
+			{
+				lzma_stream init = LZMA_STREAM_INIT;
+				lzma_ret ret;
+#if LZMA_VERSION >= 50040002
+				lzma_mt mt;
+				long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+				dec->lzma = init;
+				/* only files written in several blocks (xz -T) are decoded in
+				 * parallel, others go through a single thread */
+				memset(&mt, 0, sizeof(mt));
+				mt.flags = LZMA_CONCATENATED;
+				mt.threads = cpus > 1 ? (uint32_t)cpus : 1;
+				mt.memlimit_threading = lzma_physmem() / 4;
+				mt.memlimit_stop = UINT64_MAX;
+				ret = lzma_stream_decoder_mt(&dec->lzma, &mt);
+#else
+				dec->lzma = init;
+				ret = lzma_stream_decoder(&dec->lzma, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+				if(ret != LZMA_OK) {
+					decoder_free(dec);
+					return(NULL);
+				}
+			}
+			break;
+#endif
+#ifdef HAVE_LIBZSTD
+		case AM_COMPRESSION_ZSTD:
+			if((dec->zstd = ZSTD_createDStream()) == NULL
+					|| ZSTD_isError(ZSTD_initDStream(dec->zstd))) {
+				decoder_free(dec);
+				return(NULL);
+			}
+			break;
+#endif
+		default:
+			decoder_free(dec);
+			return(NULL);
+	}
+
+	if((dec->fd = open(path, O_RDONLY)) == -1) {
+		decoder_free(dec);
+		return(NULL);
+	}
+	return(dec);
+}
+
+/* Refill the compressed buffer once it has been used up. */
+static int decoder_fill(struct archive *a, struct decoder *dec)
+{
+	ssize_t len;
+
+	if(dec->inpos < dec->inlen || dec->ineof) {
+		return(0);
+	}
+	do {
+		len = read(dec->fd, dec->in, sizeof(dec->in));
+	} while(len == -1 && errno == EINTR);
+	if(len == -1) {
+		archive_set_error(a, errno, "read error");
+		return(-1);
+	}
+	dec->inpos = 0;
+	dec->inlen = (size_t)len;
+	if(dec->rawpos) {
+		*dec->rawpos += len;
+	}
+	dec->ineof = (len == 0);
+	return(0);
+}
+
+/* read callback for libarchive, hands out the next decompressed block */
+static ssize_t decoder_read(struct archive *a, void *data, const void **buff)
+{
+	struct decoder *dec = data;
+	size_t outlen = 0;
+
+	*buff = dec->out;
+
+	while(outlen == 0) {
+		if(decoder_fill(a, dec) != 0) {
+			return(-1);
+		}
+#ifdef HAVE_LIBLZMA
+		if(dec->type == AM_COMPRESSION_XZ) {
+			lzma_ret ret;
+			dec->lzma.next_in = dec->in + dec->inpos;
+			dec->lzma.avail_in = dec->inlen - dec->inpos;
+			dec->lzma.next_out = dec->out;
+			dec->lzma.avail_out = sizeof(dec->out);
+			ret = lzma_code(&dec->lzma, dec->ineof ? LZMA_FINISH : LZMA_RUN);
+			dec->inpos = dec->inlen - dec->lzma.avail_in;
+			outlen = sizeof(dec->out) - dec->lzma.avail_out;
+			if(ret == LZMA_STREAM_END) {
+				break;
+			} else if(ret != LZMA_OK) {
+				archive_set_error(a, DECODER_ERRNO,
+						"xz decompression failed (%d)", (int)ret);
+				return(-1);
+			}
+		}
+#endif
+#ifdef HAVE_LIBZSTD
+		if(dec->type == AM_COMPRESSION_ZSTD) {
+			ZSTD_inBuffer in = { dec->in, dec->inlen, dec->inpos };
+			ZSTD_outBuffer out = { dec->out, sizeof(dec->out), 0 };
+			size_t ret = ZSTD_decompressStream(dec->zstd, &out, &in);
+			if(ZSTD_isError(ret)) {
+				archive_set_error(a, DECODER_ERRNO,
+						"zstd decompression failed: %s", ZSTD_getErrorName(ret));
+				return(-1);
+			}
+			dec->inpos = in.pos;
+			outlen = out.pos;
+			/* ret is 0 between frames, more of them may follow */
+			if(outlen == 0 && dec->ineof) {
+				if(ret != 0) {
+					archive_set_error(a, DECODER_ERRNO, "truncated zstd data");
+					return(-1);
+				}
+				break;
+			}
+		}
+#endif
+	}
+
+	return((ssize_t)outlen);
+}
+
+static int decoder_close(struct archive *a, void *data)
+{
+	decoder_free(data);
+	return(ARCHIVE_OK);
+}
+
+#endif /* HAVE_LIBLZMA || HAVE_LIBZSTD */
+
+/** Open an archive for reading with all formats and compressions enabled.
+ * xz files are decoded with several threads if liblzma allows it, and
+ * zstd files are decoded with libzstd, whatever libarchive supports.
+ * libarchive only sees the decoded data of those, so its compressed
+ * position does not tell how much of the file was read.
+ * @param path the archive to open
+ * @param rawpos if not NULL, set to -1 if the compressed position of
+ * libarchive is right, else to 0 and then kept up to date with the bytes
+ * of the file read so far
+ * @return the archive, or NULL with am_errno set on error
+ */
+struct archive *_alam_archive_open(const char *path, int64_t *rawpos)
+{
+	struct archive *archive;
+	int ret;
+
+	if((archive = archive_read_new()) == NULL) {
+		RET_ERR(AM_ERR_LIBARCHIVE, NULL);
+	}
+
+	archive_read_support_compression_all(archive);
+	archive_read_support_format_all(archive);
+	if(rawpos) {
+		*rawpos = -1;
+	}
+
+#if defined(HAVE_LIBLZMA) || defined(HAVE_LIBZSTD)
+	{
+		amcompression_t type = _alam_compression(path);
+		struct decoder *dec = NULL;
+
+		if(type == AM_COMPRESSION_XZ || type == AM_COMPRESSION_ZSTD) {
+			dec = decoder_new(path, type);
+		}
+		if(dec) {
+			dec->rawpos = rawpos;
+			if(rawpos) {
+				*rawpos = 0;
+			}
+			_alam_log(AM_LOG_DEBUG, "decompressing %s with %s\n", path,
+					type == AM_COMPRESSION_XZ ? "liblzma" : "libzstd");
+			/* the close callback frees the decoder, even on failure */
+			if(archive_read_open(archive, dec, NULL, decoder_read,
+						decoder_close) != ARCHIVE_OK) {
+				_alam_log(AM_LOG_DEBUG, "could not open %s: %s\n", path,
+						archive_error_string(archive));
+				archive_read_finish(archive);
+				RET_ERR(AM_ERR_PKG_OPEN, NULL);
+			}
+			return(archive);
+		}
+	}
+#endif
+
+	ret = archive_read_open_filename(archive, path,
+			ARCHIVE_DEFAULT_BYTES_PER_BLOCK);
+	if(ret != ARCHIVE_OK) {
+		_alam_log(AM_LOG_DEBUG, "could not open %s: %s\n", path,
+				archive_error_string(archive));
+		archive_read_finish(archive);
+		RET_ERR(AM_ERR_PKG_OPEN, NULL);
+	}
+	return(archive);
+}
+
+/* vim: set ts=2 sw=2 noet: */
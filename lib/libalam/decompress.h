@@ -0,0 +1,39 @@
+/*
+ *  decompress.h
+ *
+ *  Copyright (c) 2006-2009 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ALAM_DECOMPRESS_H
+#define _ALAM_DECOMPRESS_H
+
+#include <stdint.h>
+#include <archive.h>
+
+typedef enum _amcompression_t {
+	AM_COMPRESSION_NONE = 0,
+	AM_COMPRESSION_GZIP,
+	AM_COMPRESSION_BZIP2,
+	AM_COMPRESSION_LZMA,
+	AM_COMPRESSION_XZ,
+	AM_COMPRESSION_ZSTD
+} amcompression_t;
+
+amcompression_t _alam_compression(const char *path);
+struct archive *_alam_archive_open(const char *path, int64_t *rawpos);
+
+#endif /* _ALAM_DECOMPRESS_H */
+
+/* vim: set ts=2 sw=2 noet: */
@@ -22,17 +22,23 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <stdint.h> /* intmax_t */
 #include <limits.h>
 #include <sys/types.h>
-#include <regex.h>
+#include <sys/wait.h>
+#include <ctype.h>
+#include <pthread.h>
 
 /* libalam */
 #include "delta.h"
 #include "alam_list.h"
 #include "util.h"
 #include "log.h"
-#include "graph.h"
+#include "hash.h"
+#include "checksum.h"
 
 /** \addtogroup alam_deltas Delta Functions
  * @brief Functions to manipulate libalam deltas
@@ -71,26 +77,106 @@ off_t SYMEXPORT alam_delta_get_size(amdelta_t *delta)
 
 /** @} */
 
-static alam_list_t *delta_graph_init(alam_list_t *deltas)
+/* A delta in the graph searched by _alam_shortest_delta_path(). Its
+ * children are the deltas starting from the file it produces. */
+struct delta_vertex {
+	amdelta_t *delta;
+	off_t weight; /* smallest download size to produce delta->to */
+	long parent; /* previous vertex on that path, -1 if none */
+	size_t heappos; /* position in the heap, 0 if not in it */
+	int done;
+};
+
+/* The vertices still to visit, a binary min-heap on (weight, index) so
+ * that ties go to the delta listed first. heap[0] is unused. */
+struct delta_heap {
+	struct delta_vertex *vertices;
+	size_t *heap;
+	size_t count;
+};
+
+static int heap_less(struct delta_heap *h, size_t a, size_t b)
+{
+	off_t wa = h->vertices[a].weight, wb = h->vertices[b].weight;
+	return(wa < wb || (wa == wb && a < b));
+}
+
+static void heap_set(struct delta_heap *h, size_t pos, size_t v)
+{
+	h->heap[pos] = v;
+	h->vertices[v].heappos = pos;
+}
+
+static void heap_up(struct delta_heap *h, size_t pos)
+{
+	size_t v = h->heap[pos];
+	while(pos > 1 && heap_less(h, v, h->heap[pos / 2])) {
+		heap_set(h, pos, h->heap[pos / 2]);
+		pos /= 2;
+	}
+	heap_set(h, pos, v);
+}
+
+static void heap_down(struct delta_heap *h, size_t pos)
 {
-	alam_list_t *i, *j;
-	alam_list_t *vertices = NULL;
-	/* create the vertices */
-	for(i = deltas; i; i = i->next) {
-		char *fpath, *md5sum;
-		pmgraph_t *v = _alam_graph_new();
+	size_t v = h->heap[pos];
+	while(pos * 2 <= h->count) {
+		size_t child = pos * 2;
+		if(child < h->count && heap_less(h, h->heap[child + 1], h->heap[child])) {
+			child++;
+		}
+		if(!heap_less(h, h->heap[child], v)) {
+			break;
+		}
+		heap_set(h, pos, h->heap[child]);
+		pos = child;
+	}
+	heap_set(h, pos, v);
+}
+
+/* Insert v, or move it up after its weight decreased. */
+static void heap_push(struct delta_heap *h, size_t v)
+{
+	if(h->vertices[v].heappos == 0) {
+		heap_set(h, ++h->count, v);
+	}
+	heap_up(h, h->vertices[v].heappos);
+}
+
+static size_t heap_pop(struct delta_heap *h)
+{
+	size_t v = h->heap[1];
+	h->vertices[v].heappos = 0;
+	if(--h->count) {
+		heap_set(h, 1, h->heap[h->count + 1]);
+		heap_down(h, 1);
+	}
+	return(v);
+}
+
+static void delta_graph_init(alam_list_t *deltas, struct delta_vertex *vertices)
+{
+	alam_list_t *i;
+	size_t n = 0;
+
+	for(i = deltas; i; i = i->next, n++) {
+		char *fpath;
+		struct delta_vertex *v = &vertices[n];
 		amdelta_t *vdelta = i->data;
 		vdelta->download_size = vdelta->delta_size;
+		v->delta = vdelta;
 		v->weight = LONG_MAX;
-
-		/* determine whether the delta file already exists */
-		fpath = _alam_filecache_find(vdelta->delta);
-		md5sum = alam_compute_md5sum(fpath);
-		if(fpath && md5sum && strcmp(md5sum, vdelta->delta_md5) == 0) {
-			vdelta->download_size = 0;
+		v->parent = -1;
+
+		/* determine whether the delta file already exists. It is only
+		 * hashed once a path uses it, unless it was found corrupted. */
+		if(vdelta->verified >= 0) {
+			fpath = _alam_filecache_find(vdelta->delta);
+			if(fpath) {
+				vdelta->download_size = 0;
+			}
+			FREE(fpath);
 		}
-		FREE(fpath);
-		FREE(md5sum);
 
 		/* determine whether a base 'from' file exists */
 		fpath = _alam_filecache_find(vdelta->from);
@@ -98,94 +184,94 @@ static alam_list_t *delta_graph_init(alam_list_t *deltas)
 			v->weight = vdelta->download_size;
 		}
 		FREE(fpath);
-
-		v->data = vdelta;
-		vertices = alam_list_add(vertices, v);
 	}
+}
 
-	/* compute the edges */
-	for(i = vertices; i; i = i->next) {
-		pmgraph_t *v_i = i->data;
-		amdelta_t *d_i = v_i->data;
-		/* loop a second time so we make all possible comparisons */
-		for(j = vertices; j; j = j->next) {
-			pmgraph_t *v_j = j->data;
-			amdelta_t *d_j = v_j->data;
-			/* We want to create a delta tree like the following:
-			 *          1_to_2
-			 *            |
-			 * 1_to_3   2_to_3
-			 *   \        /
-			 *     3_to_4
-			 * If J 'from' is equal to I 'to', then J is a child of I.
-			 * */
-			if(strcmp(d_j->from, d_i->to) == 0) {
-				v_i->children = alam_list_add(v_i->children, v_j);
-			}
-		}
-		v_i->childptr = v_i->children;
+static int vertex_from_cmp(const void *p1, const void *p2)
+{
+	const struct delta_vertex *v1 = *(struct delta_vertex * const *)p1;
+	const struct delta_vertex *v2 = *(struct delta_vertex * const *)p2;
+	int cmp = strcmp(v1->delta->from, v2->delta->from);
+	if(cmp == 0) {
+		cmp = v1 < v2 ? -1 : (v1 > v2);
 	}
-	return(vertices);
+	return(cmp);
 }
 
-static off_t delta_vert(alam_list_t *vertices,
-		const char *to, alam_list_t **path) {
-	alam_list_t *i;
-	pmgraph_t *v;
-	while(1) {
-		v = NULL;
-		/* find the smallest vertice not visited yet */
-		for(i = vertices; i; i = i->next) {
-			pmgraph_t *v_i = i->data;
-
-			if(v_i->state == -1) {
-				continue;
-			}
+/* Dijkstra over the deltas: J is a child of I when J 'from' is I 'to'.
+ *          1_to_2
+ *            |
+ * 1_to_3   2_to_3
+ *   \        /
+ *     3_to_4
+ * The children of a vertex are found in byfrom, the vertices sorted by
+ * their 'from' file. */
+static off_t delta_vert(struct delta_vertex *vertices, size_t count,
+		const char *to, alam_list_t **path)
+{
+	struct delta_heap h;
+	struct delta_vertex **byfrom;
+	size_t n;
+	long best = -1;
+	off_t bestsize = 0;
+	alam_list_t *rpath = NULL;
 
-			if(v == NULL || v_i->weight < v->weight) {
-				v = v_i;
-			}
+	*path = NULL;
+	MALLOC(byfrom, count * sizeof(struct delta_vertex *),
+			RET_ERR(AM_ERR_MEMORY, LONG_MAX));
+	MALLOC(h.heap, (count + 1) * sizeof(size_t),
+			free(byfrom); RET_ERR(AM_ERR_MEMORY, LONG_MAX));
+	h.vertices = vertices;
+	h.count = 0;
+
+	for(n = 0; n < count; n++) {
+		byfrom[n] = &vertices[n];
+		if(vertices[n].weight != LONG_MAX) {
+			heap_push(&h, n);
 		}
-		if(v == NULL || v->weight == LONG_MAX) {
-			break;
+	}
+	qsort(byfrom, count, sizeof(struct delta_vertex *), vertex_from_cmp);
+
+	while(h.count) {
+		struct delta_vertex *v = &vertices[heap_pop(&h)];
+		const char *vto = v->delta->to;
+		size_t lo = 0, hi = count;
+
+		v->done = 1;
+
+		/* first vertex starting from v's 'to' */
+		while(lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if(strcmp(byfrom[mid]->delta->from, vto) < 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
 		}
-
-		v->state = -1;
-
-		v->childptr = v->children;
-		while(v->childptr) {
-			pmgraph_t *v_c = v->childptr->data;
-			amdelta_t *d_c = v_c->data;
-			if(v_c->weight > v->weight + d_c->download_size) {
-				v_c->weight = v->weight + d_c->download_size;
-				v_c->parent = v;
+		for(; lo < count && strcmp(byfrom[lo]->delta->from, vto) == 0; lo++) {
+			struct delta_vertex *c = byfrom[lo];
+			if(!c->done && c->weight > v->weight + c->delta->download_size) {
+				c->weight = v->weight + c->delta->download_size;
+				c->parent = v - vertices;
+				heap_push(&h, c - vertices);
 			}
-
-			v->childptr = (v->childptr)->next;
-
 		}
 	}
-
-	v = NULL;
-	off_t bestsize = 0;
-
-	for(i = vertices; i; i = i->next) {
-		pmgraph_t *v_i = i->data;
-		amdelta_t *d_i = v_i->data;
-
-		if(strcmp(d_i->to, to) == 0) {
-			if(v == NULL || v_i->weight < v->weight) {
-				v = v_i;
-				bestsize = v->weight;
+	free(h.heap);
+	free(byfrom);
+
+	for(n = 0; n < count; n++) {
+		if(strcmp(vertices[n].delta->to, to) == 0) {
+			if(best == -1 || vertices[n].weight < vertices[best].weight) {
+				best = n;
+				bestsize = vertices[n].weight;
 			}
 		}
 	}
 
-	alam_list_t *rpath = NULL;
-	while(v != NULL) {
-		amdelta_t *vdelta = v->data;
-		rpath = alam_list_add(rpath, vdelta);
-		v = v->parent;
+	while(best != -1) {
+		rpath = alam_list_add(rpath, vertices[best].delta);
+		best = vertices[best].parent;
 	}
 	*path = alam_list_reverse(rpath);
 	alam_list_free(rpath);
@@ -207,7 +293,8 @@ off_t _alam_shortest_delta_path(alam_list_t *deltas,
 		const char *to, alam_list_t **path)
 {
 	alam_list_t *bestpath = NULL;
-	alam_list_t *vertices;
+	struct delta_vertex *vertices;
+	size_t count;
 	off_t bestsize = LONG_MAX;
 
 	ALAM_LOG_FUNC;
@@ -219,72 +306,274 @@ off_t _alam_shortest_delta_path(alam_list_t *deltas,
 
 	_alam_log(AM_LOG_DEBUG, "started delta shortest-path search for '%s'\n", to);
 
-	vertices = delta_graph_init(deltas);
+	count = alam_list_count(deltas);
+	CALLOC(vertices, count, sizeof(struct delta_vertex),
+			*path = NULL; RET_ERR(AM_ERR_MEMORY, bestsize));
+	delta_graph_init(deltas, vertices);
 
-	bestsize = delta_vert(vertices, to, &bestpath);
+	bestsize = delta_vert(vertices, count, to, &bestpath);
 
 	_alam_log(AM_LOG_DEBUG, "delta shortest-path search complete : '%jd'\n", (intmax_t)bestsize);
 
-	alam_list_free_inner(vertices, _alam_graph_free);
-	alam_list_free(vertices);
+	free(vertices);
 
 	*path = bestpath;
 	return(bestsize);
 }
 
+/* Deltas may be applied by several threads. A pipe made by one of them must
+ * not leak into a command started by another before it is marked close on
+ * exec, or a reader could wait for the end of its input forever. */
+static pthread_mutex_t spawn_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A pipe whose ends are not inherited by the commands started later. */
+static int delta_pipe(int fds[2])
+{
+	if(pipe(fds) != 0) {
+		_alam_log(AM_LOG_ERROR, _("could not create pipe (%s)\n"), strerror(errno));
+		return(-1);
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	return(0);
+}
+
+/* Start a command reading infd and writing outfd, -1 keeps our own. */
+static pid_t delta_spawn(char *const argv[], int infd, int outfd)
+{
+	pid_t pid = fork();
+
+	if(pid == 0) {
+		if(infd != -1) {
+			dup2(infd, STDIN_FILENO);
+		}
+		if(outfd != -1) {
+			dup2(outfd, STDOUT_FILENO);
+		}
+		execvp(argv[0], argv);
+		_exit(127);
+	} else if(pid == -1) {
+		_alam_log(AM_LOG_ERROR, _("could not fork a new process (%s)\n"),
+				strerror(errno));
+	}
+	return(pid);
+}
+
+static int delta_wait(pid_t pid, const char *name)
+{
+	int status;
+
+	if(pid == -1) {
+		return(-1);
+	}
+	while(waitpid(pid, &status, 0) == -1) {
+		if(errno != EINTR) {
+			return(-1);
+		}
+	}
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		_alam_log(AM_LOG_DEBUG, "%s failed with status %d\n", name, status);
+		return(-1);
+	}
+	return(0);
+}
+
+/** Applies a delta file to create a package file.
+ * xdelta3 and, for gzip packages, gzip -n are run directly rather than
+ * through a shell. gzip, and not an in-process compressor, is what gives
+ * back the package byte for byte. Their output is hashed as it is
+ * written, so the checksum test of the new package does not read it
+ * again, see _alam_checksum_store().
+ * @param from the file the delta applies to
+ * @param delta the delta file
+ * @param to the file to create
+ * @return 0 on success, -1 on error
+ */
+int _alam_delta_apply(const char *from, const char *delta, const char *to)
+{
+	char *xdelta[9], *gzip[] = { "gzip", "-n", NULL };
+	pid_t xdelta_pid = -1, gzip_pid = -1;
+	int patch[2] = { -1, -1 }, out[2] = { -1, -1 };
+	int fd, n = 0, hashing = 0, ret = 0;
+	amhash_t sums[2];
+	char buf[64 * 1024];
+	ssize_t len;
+
+	ALAM_LOG_FUNC;
+
+	ASSERT(from != NULL && delta != NULL, return(-1));
+
+	xdelta[n++] = "xdelta3";
+	xdelta[n++] = "-d";
+	xdelta[n++] = "-q";
+	if(strlen(to) > 3 && strcmp(to + strlen(to) - 3, ".gz") == 0) {
+		/* special handling for gzip : we disable timestamp with -n option */
+		xdelta[n++] = "-R";
+	} else {
+		gzip[0] = NULL;
+	}
+	xdelta[n++] = "-c";
+	xdelta[n++] = "-s";
+	xdelta[n++] = (char *)from;
+	xdelta[n++] = (char *)delta;
+	xdelta[n] = NULL;
+
+	_alam_log(AM_LOG_DEBUG, "applying %s to %s%s\n", delta, from,
+			gzip[0] ? " through gzip -n" : "");
+
+	if((fd = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		_alam_log(AM_LOG_ERROR, _("could not open file %s: %s\n"), to,
+				strerror(errno));
+		return(-1);
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	pthread_mutex_lock(&spawn_lock);
+	if(delta_pipe(out) != 0) {
+		pthread_mutex_unlock(&spawn_lock);
+		ret = -1;
+		goto cleanup;
+	}
+	if(gzip[0]) {
+		if(delta_pipe(patch) != 0) {
+			pthread_mutex_unlock(&spawn_lock);
+			ret = -1;
+			goto cleanup;
+		}
+		xdelta_pid = delta_spawn(xdelta, -1, patch[1]);
+		gzip_pid = delta_spawn(gzip, patch[0], out[1]);
+		close(patch[0]);
+		close(patch[1]);
+	} else {
+		xdelta_pid = delta_spawn(xdelta, -1, out[1]);
+	}
+	pthread_mutex_unlock(&spawn_lock);
+	close(out[1]);
+	out[1] = -1;
+
+	hashing = (_alam_hash_init(&sums[AM_HASH_MD5], AM_HASH_MD5) == 0);
+	if(hashing && _alam_hash_init(&sums[AM_HASH_SHA256], AM_HASH_SHA256) != 0) {
+		_alam_hash_abort(&sums[AM_HASH_MD5]);
+		hashing = 0;
+	}
+	while((len = read(out[0], buf, sizeof(buf))) != 0) {
+		ssize_t done = 0;
+		if(len == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			ret = -1;
+			break;
+		}
+		if(hashing) {
+			_alam_hash_update(&sums[AM_HASH_MD5], buf, len);
+			_alam_hash_update(&sums[AM_HASH_SHA256], buf, len);
+		}
+		while(done < len) {
+			ssize_t w = write(fd, buf + done, len - done);
+			if(w == -1 && errno != EINTR) {
+				_alam_log(AM_LOG_ERROR, _("could not write to %s (%s)\n"), to,
+						strerror(errno));
+				ret = -1;
+				break;
+			}
+			done += w > 0 ? w : 0;
+		}
+		if(ret != 0) {
+			break;
+		}
+	}
+	/* the commands get SIGPIPE if we stopped early */
+	close(out[0]);
+	out[0] = -1;
+
+	if(delta_wait(xdelta_pid, "xdelta3") != 0) {
+		ret = -1;
+	}
+	if(gzip[0] && delta_wait(gzip_pid, "gzip") != 0) {
+		ret = -1;
+	}
+
+cleanup:
+	if(out[0] != -1) {
+		close(out[0]);
+	}
+	if(out[1] != -1) {
+		close(out[1]);
+	}
+	if(close(fd) != 0) {
+		ret = -1;
+	}
+	if(ret != 0) {
+		if(hashing) {
+			_alam_hash_abort(&sums[AM_HASH_MD5]);
+			_alam_hash_abort(&sums[AM_HASH_SHA256]);
+		}
+		unlink(to);
+		_alam_checksum_forget(to);
+	} else if(hashing) {
+		char *md5sum = _alam_hash_final(&sums[AM_HASH_MD5]);
+		char *sha256sum = _alam_hash_final(&sums[AM_HASH_SHA256]);
+		_alam_checksum_store(to, NULL, md5sum, sha256sum);
+		FREE(md5sum);
+		FREE(sha256sum);
+	}
+	return(ret);
+}
+
 /** Parses the string representation of a amdelta_t object.
- * This function assumes that the string is in the correct format.
  * This format is as follows:
  * $deltafile $deltamd5 $deltasize $oldfile $newfile
+ * The fields are separated by single spaces and hold no other whitespace,
+ * the md5 has 32 hex digits and the size only digits. The line is
+ * checked and split in a single pass, and is left alone if invalid.
  * @param line the string to parse
- * @return A pointer to the new amdelta_t object
+ * @return A pointer to the new amdelta_t object, NULL if line is invalid
  */
 /* TODO this does not really belong here, but in a parsing lib */
 amdelta_t *_alam_delta_parse(char *line)
 {
 	amdelta_t *delta;
-	char *tmp = line, *tmp2;
-	regex_t reg;
-
-	regcomp(&reg,
-			"^[^[:space:]]* [[:xdigit:]]{32} [[:digit:]]*"
-			" [^[:space:]]* [^[:space:]]*$",
-			REG_EXTENDED | REG_NOSUB | REG_NEWLINE);
-	if(regexec(&reg, line, 0, 0, 0) != 0) {
-		/* delta line is invalid, return NULL */
-		regfree(&reg);
+	char *sep[4];
+	char *p;
+	int n = 0;
+
+	for(p = line; *p; p++) {
+		if(*p == ' ') {
+			if(n == 4) {
+				return(NULL);
+			}
+			sep[n++] = p;
+		} else if(isspace((unsigned char)*p)) {
+			return(NULL);
+		} else if(n == 1 && !isxdigit((unsigned char)*p)) {
+			return(NULL);
+		} else if(n == 2 && !isdigit((unsigned char)*p)) {
+			return(NULL);
+		}
+	}
+	if(n != 4 || sep[1] - sep[0] != 33) {
+		/* delta line is invalid */
 		return(NULL);
 	}
-	regfree(&reg);
+	for(n = 0; n < 4; n++) {
+		*sep[n] = '\0';
+	}
 
 	CALLOC(delta, 1, sizeof(amdelta_t), RET_ERR(AM_ERR_MEMORY, NULL));
-
-	tmp2 = tmp;
-	tmp = strchr(tmp, ' ');
-	*(tmp++) = '\0';
-	STRDUP(delta->delta, tmp2, RET_ERR(AM_ERR_MEMORY, NULL));
-
-	tmp2 = tmp;
-	tmp = strchr(tmp, ' ');
-	*(tmp++) = '\0';
-	STRDUP(delta->delta_md5, tmp2, RET_ERR(AM_ERR_MEMORY, NULL));
-
-	tmp2 = tmp;
-	tmp = strchr(tmp, ' ');
-	*(tmp++) = '\0';
-	delta->delta_size = atol(tmp2);
-
-	tmp2 = tmp;
-	tmp = strchr(tmp, ' ');
-	*(tmp++) = '\0';
-	STRDUP(delta->from, tmp2, RET_ERR(AM_ERR_MEMORY, NULL));
-
-	tmp2 = tmp;
-	STRDUP(delta->to, tmp2, RET_ERR(AM_ERR_MEMORY, NULL));
+	STRDUP(delta->delta, line, goto error);
+	STRDUP(delta->delta_md5, sep[0] + 1, goto error);
+	delta->delta_size = (off_t)strtoll(sep[1] + 1, NULL, 10);
+	STRDUP(delta->from, sep[2] + 1, goto error);
+	STRDUP(delta->to, sep[3] + 1, goto error);
 
 	_alam_log(AM_LOG_DEBUG, "delta : %s %s '%lld'\n", delta->from, delta->to, (long long)delta->delta_size);
 
 	return(delta);
+
+error:
+	_alam_delta_free(delta);
+	RET_ERR(AM_ERR_MEMORY, NULL);
 }
 
 void _alam_delta_free(amdelta_t *delta)
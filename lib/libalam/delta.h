@@ -37,12 +37,16 @@ struct __amdelta_t {
 	char *to;
 	/** download filesize of the delta file */
 	off_t download_size;
+	/** whether the delta file in the cache matched delta_md5: 1 if it did,
+	 * -1 if it did not, 0 if it was not checked */
+	int verified;
 };
 
 amdelta_t *_alam_delta_parse(char *line);
 void _alam_delta_free(amdelta_t *delta);
 off_t _alam_shortest_delta_path(alam_list_t *deltas,
 		const char *to, alam_list_t **path);
+int _alam_delta_apply(const char *from, const char *delta, const char *to);
 
 #endif /* _ALAM_DELTA_H */
 
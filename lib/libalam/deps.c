@@ -347,70 +347,73 @@ int SYMEXPORT alam_depcmp(ampkg_t *pkg, amdepend_t *dep)
 
 	/* check provisions, format : "name=version" */
 	for(i = alam_pkg_get_provides(pkg); i && !satisfy; i = i->next) {
-		char *provname = strdup(i->data);
-		char *provver = strchr(provname, '=');
+		const char *provname = i->data;
+		const char *provver = strchr(provname, '=');
 
 		if(provver == NULL) { /* no provision version */
 			satisfy = (dep->mod == AM_DEP_MOD_ANY
 					&& strcmp(provname, dep->name) == 0);
 		} else {
-			*provver = '\0';
-			provver += 1;
-			satisfy = (strcmp(provname, dep->name) == 0
-					&& dep_vercmp(provver, dep->mod, dep->version));
+			size_t namelen = provver - provname;
+			satisfy = (strncmp(provname, dep->name, namelen) == 0
+					&& dep->name[namelen] == '\0'
+					&& dep_vercmp(provver + 1, dep->mod, dep->version));
 		}
-		free(provname);
 	}
 
 	return(satisfy);
 }
 
-amdepend_t *_alam_splitdep(const char *depstring)
+/* Split a dependency string in place: the name is terminated at the
+ * version comparator, which is stored in mod. Returns the version, or NULL
+ * if there is none. */
+static char *splitdep_inplace(char *str, amdepmod_t *mod)
 {
-	amdepend_t *depend;
-	char *ptr = NULL;
-	char *newstr = NULL;
-
-	if(depstring == NULL) {
-		return(NULL);
-	}
-	STRDUP(newstr, depstring, RET_ERR(AM_ERR_MEMORY, NULL));
-
-	CALLOC(depend, 1, sizeof(amdepend_t), RET_ERR(AM_ERR_MEMORY, NULL));
+	char *ptr;
 
 	/* Find a version comparator if one exists. If it does, set the type and
 	 * increment the ptr accordingly so we can copy the right strings. */
-	if((ptr = strstr(newstr, ">="))) {
-		depend->mod = AM_DEP_MOD_GE;
+	if((ptr = strstr(str, ">="))) {
+		*mod = AM_DEP_MOD_GE;
 		*ptr = '\0';
 		ptr += 2;
-	} else if((ptr = strstr(newstr, "<="))) {
-		depend->mod = AM_DEP_MOD_LE;
+	} else if((ptr = strstr(str, "<="))) {
+		*mod = AM_DEP_MOD_LE;
 		*ptr = '\0';
 		ptr += 2;
-	} else if((ptr = strstr(newstr, "="))) { /* Note: we must do =,<,> checks after <=, >= checks */
-		depend->mod = AM_DEP_MOD_EQ;
+	} else if((ptr = strstr(str, "="))) { /* Note: we must do =,<,> checks after <=, >= checks */
+		*mod = AM_DEP_MOD_EQ;
 		*ptr = '\0';
 		ptr += 1;
-	} else if((ptr = strstr(newstr, "<"))) {
-		depend->mod = AM_DEP_MOD_LT;
+	} else if((ptr = strstr(str, "<"))) {
+		*mod = AM_DEP_MOD_LT;
 		*ptr = '\0';
 		ptr += 1;
-	} else if((ptr = strstr(newstr, ">"))) {
-		depend->mod = AM_DEP_MOD_GT;
+	} else if((ptr = strstr(str, ">"))) {
+		*mod = AM_DEP_MOD_GT;
 		*ptr = '\0';
 		ptr += 1;
 	} else {
-		/* no version specified - copy the name and return it */
-		depend->mod = AM_DEP_MOD_ANY;
-		STRDUP(depend->name, newstr, RET_ERR(AM_ERR_MEMORY, NULL));
-		depend->version = NULL;
-		free(newstr);
-		return(depend);
+		/* no version specified */
+		*mod = AM_DEP_MOD_ANY;
 	}
+	return(ptr);
+}
+
+amdepend_t *_alam_splitdep(const char *depstring)
+{
+	amdepend_t *depend;
+	char *ptr = NULL;
+	char *newstr = NULL;
 
-	/* if we get here, we have a version comparator, copy the right parts
-	 * to the right places */
+	if(depstring == NULL) {
+		return(NULL);
+	}
+	STRDUP(newstr, depstring, RET_ERR(AM_ERR_MEMORY, NULL));
+
+	CALLOC(depend, 1, sizeof(amdepend_t), RET_ERR(AM_ERR_MEMORY, NULL));
+
+	ptr = splitdep_inplace(newstr, &depend->mod);
 	STRDUP(depend->name, newstr, RET_ERR(AM_ERR_MEMORY, NULL));
 	STRDUP(depend->version, ptr, RET_ERR(AM_ERR_MEMORY, NULL));
 	free(newstr);
@@ -418,6 +421,34 @@ amdepend_t *_alam_splitdep(const char *depstring)
 	return(depend);
 }
 
+/** Like _alam_splitdep(), with everything allocated from arena. The name
+ * and version are interned, they repeat a lot across a db. */
+amdepend_t *_alam_splitdep_arena(amarena_t *arena, const char *depstring)
+{
+	amdepend_t *depend;
+	char buf[PATH_MAX];
+	char *ptr;
+
+	if(depstring == NULL) {
+		return(NULL);
+	}
+	if(strlen(depstring) >= sizeof(buf)) {
+		RET_ERR(AM_ERR_WRONG_ARGS, NULL);
+	}
+	strcpy(buf, depstring);
+
+	if((depend = _alam_arena_alloc(arena, sizeof(amdepend_t))) == NULL) {
+		RET_ERR(AM_ERR_MEMORY, NULL);
+	}
+	ptr = splitdep_inplace(buf, &depend->mod);
+	if((depend->name = _alam_arena_intern(arena, buf)) == NULL
+			|| (ptr && (depend->version = _alam_arena_intern(arena, ptr)) == NULL)) {
+		RET_ERR(AM_ERR_MEMORY, NULL);
+	}
+
+	return(depend);
+}
+
 amdepend_t *_alam_dep_dup(const amdepend_t *dep)
 {
 	amdepend_t *newdep;
@@ -505,6 +536,49 @@ void _alam_recursedeps(amdb_t *db, alam_list_t *targs, int include_explicit)
 	}
 }
 
+/* Picks the package satisfying dep in the sync dbs, like
+ * _alam_resolvedep() does, from the repo indexes of the handle. */
+static ampkg_t *resolvedep_indexed(amdepend_t *dep, alam_list_t *excluding,
+		int prompt, int *ignored)
+{
+	amrepoentry_t *entries;
+	size_t count, n;
+	int provides;
+
+	for(provides = 0; provides < 2; provides++) {
+		entries = _alam_repoindex_find(dep->name, provides, &count);
+		for(n = 0; n < count; n++) {
+			ampkg_t *pkg = entries[n].pkg;
+			/* a literal also providing its own name was already looked at */
+			if(provides && strcmp(pkg->name, dep->name) == 0) {
+				continue;
+			}
+			if(!alam_depcmp(pkg, dep) || _alam_pkg_find(excluding, pkg->name)) {
+				continue;
+			}
+			if(_alam_pkg_should_ignore(pkg)) {
+				int install = 0;
+				if (prompt) {
+					QUESTION(handle->trans, AM_TRANS_CONV_INSTALL_IGNOREPKG, pkg,
+							 NULL, NULL, &install);
+				} else {
+					_alam_log(AM_LOG_WARNING, _("ignoring package %s-%s\n"), pkg->name, pkg->version);
+				}
+				if(!install) {
+					*ignored = 1;
+					continue;
+				}
+			}
+			if(provides) {
+				_alam_log(AM_LOG_WARNING, _("provider package was selected (%s provides %s)\n"),
+				                         pkg->name, dep->name);
+			}
+			return(pkg);
+		}
+	}
+	return(NULL);
+}
+
 /**
  * helper function for resolvedeps: search for dep satisfier in dbs
  *
@@ -522,6 +596,16 @@ ampkg_t *_alam_resolvedep(amdepend_t *dep, alam_list_t *dbs,
 {
 	alam_list_t *i, *j;
 	int ignored = 0;
+
+	/* without the indexes, the dbs are searched one by one below */
+	if(handle && dbs && dbs == handle->dbs_sync && _alam_repoindex_load() == 0) {
+		ampkg_t *pkg = resolvedep_indexed(dep, excluding, prompt, &ignored);
+		if(pkg) {
+			return(pkg);
+		}
+		goto notfound;
+	}
+
 	/* 1. literals */
 	for(i = dbs; i; i = i->next) {
 		ampkg_t *pkg = _alam_db_get_pkgfromcache(i->data, dep->name);
@@ -567,6 +651,7 @@ ampkg_t *_alam_resolvedep(amdepend_t *dep, alam_list_t *dbs,
 			}
 		}
 	}
+notfound:
 	if(ignored) { /* resolvedeps will override these */
 		am_errno = AM_ERR_PKG_IGNORED;
 	} else {
@@ -26,6 +26,7 @@
 #include "sync.h"
 #include "package.h"
 #include "alam.h"
+#include "arena.h"
 
 /* Dependency */
 struct __amdepend_t {
@@ -54,6 +55,7 @@ int _alam_resolvedeps(amdb_t *local, alam_list_t *dbs_sync, ampkg_t *pkg,
 		alam_list_t **data);
 int _alam_dep_edge(ampkg_t *pkg1, ampkg_t *pkg2);
 amdepend_t *_alam_splitdep(const char *depstring);
+amdepend_t *_alam_splitdep_arena(amarena_t *arena, const char *depstring);
 ampkg_t *_alam_find_dep_satisfier(alam_list_t *pkgs, amdepend_t *dep);
 
 #endif /* _ALAM_DEPS_H */
@@ -25,8 +25,12 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 /* the following two are needed on BSD for libfetch */
 #if defined(HAVE_SYS_SYSLIMITS_H)
 #include <sys/syslimits.h> /* PATH_MAX */
@@ -35,7 +39,9 @@
 #include <sys/param.h> /* MAXHOSTNAMELEN */
 #endif
 
-#if defined(INTERNAL_DOWNLOAD)
+#if defined(CURL_DOWNLOAD)
+#include <curl/curl.h>
+#elif defined(INTERNAL_DOWNLOAD)
 #include <fetch.h>
 #endif
 
@@ -46,6 +52,69 @@
 #include "log.h"
 #include "util.h"
 #include "handle.h"
+#include "mirror.h"
+#include "hash.h"
+#include "checksum.h"
+
+/* state shared by the transfers of one _alam_download_files() call */
+struct dload_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t slotfree;
+	alam_list_t *next;      /* next file to hand out */
+	alam_list_t *servers;
+	const char *localpath;
+	int *active;            /* transfers in flight, one counter per server */
+	int maxconns;           /* per-server cap, 0 for none */
+	int errors;
+	int inflight;           /* transfers running, over all servers */
+	unsigned int started;   /* transfers started so far */
+};
+
+#if defined(CURL_DOWNLOAD)
+/* connections, DNS and TLS sessions shared by every transfer, so that
+ * files from the same mirror go over an already open connection */
+static CURLSH *curlshare = NULL;
+static pthread_mutex_t curlshare_lock[CURL_LOCK_DATA_LAST];
+
+/* one byte range of a segmented download */
+struct curl_segment {
+	struct curl_split *split;
+	const char *server;
+	CURL *curl;
+	off_t pos;              /* next offset to write */
+	off_t end;              /* last byte of the range, -1 for all of it */
+	pthread_t thread;
+	int started;
+	int ret;
+};
+
+/* a file downloaded from several servers at once, see download_segmented() */
+struct curl_split {
+	pthread_mutex_t lock;
+	const char *filename;
+	alam_list_t *servers;
+	int fd;
+	off_t total;            /* file size, -1 while unknown */
+	off_t done;             /* bytes written by all segments */
+	int whole;              /* the server replied with the whole file */
+	struct curl_segment *segs;
+	int nsegs;
+	int threads;            /* segments fetched in their own thread */
+	int hashing;            /* sums cover the file up to hashed */
+	off_t hashed;
+	amhash_t sums[2];
+};
+
+/* state of a single libcurl transfer */
+struct curl_transfer {
+	const char *filename;
+	FILE *localf;
+	off_t offset;           /* bytes already present from a resumed download */
+	int initialized;
+	int hashing;            /* sums cover the file from its first byte */
+	amhash_t sums[2];
+};
+#endif
 
 static char *get_filename(const char *url) {
 	char *filename = strrchr(url, '/');
@@ -55,7 +124,17 @@ static char *get_filename(const char *url) {
 	return(filename);
 }
 
-#if defined(INTERNAL_DOWNLOAD)
+static char *get_fileurl(const char *server, const char *filename)
+{
+	char *fileurl;
+	/* len = server len + '/' + filename len + null */
+	int len = strlen(server) + strlen(filename) + 2;
+	CALLOC(fileurl, len, sizeof(char), RET_ERR(AM_ERR_MEMORY, NULL));
+	snprintf(fileurl, len, "%s/%s", server, filename);
+
+	return(fileurl);
+}
+
 static char *get_destfile(const char *path, const char *filename) {
 	char *destfile;
 	/* len = localpath len + filename len + null */
@@ -66,6 +145,8 @@ static char *get_destfile(const char *path, const char *filename) {
 	return(destfile);
 }
 
+#if defined(INTERNAL_DOWNLOAD) || defined(CURL_DOWNLOAD)
+
 static char *get_tempfile(const char *path, const char *filename) {
 	char *tempfile;
 	/* len = localpath len + filename len + '.part' len + null */
@@ -76,6 +157,576 @@ static char *get_tempfile(const char *path, const char *filename) {
 	return(tempfile);
 }
 
+/* Packages are hashed as they are written, so that the integrity check
+ * does not have to read them again, see _alam_checksum_store(). Both sums
+ * are kept since the repo may provide either. */
+static int sums_start(amhash_t sums[2])
+{
+	if(_alam_hash_init(&sums[AM_HASH_MD5], AM_HASH_MD5) != 0) {
+		return(0);
+	}
+	if(_alam_hash_init(&sums[AM_HASH_SHA256], AM_HASH_SHA256) != 0) {
+		_alam_hash_abort(&sums[AM_HASH_MD5]);
+		return(0);
+	}
+	return(1);
+}
+
+static void sums_update(amhash_t sums[2], const void *buf, size_t len)
+{
+	_alam_hash_update(&sums[AM_HASH_MD5], buf, len);
+	_alam_hash_update(&sums[AM_HASH_SHA256], buf, len);
+}
+
+static void sums_abort(amhash_t sums[2])
+{
+	_alam_hash_abort(&sums[AM_HASH_MD5]);
+	_alam_hash_abort(&sums[AM_HASH_SHA256]);
+}
+
+static void sums_store(amhash_t sums[2], const char *destfile)
+{
+	char *md5sum = _alam_hash_final(&sums[AM_HASH_MD5]);
+	char *sha256sum = _alam_hash_final(&sums[AM_HASH_SHA256]);
+
+	_alam_checksum_store(destfile, NULL, md5sum, sha256sum);
+	FREE(md5sum);
+	FREE(sha256sum);
+}
+#endif
+
+#if defined(CURL_DOWNLOAD)
+static void curlshare_lockfn(CURL *curl, curl_lock_data data,
+		curl_lock_access access, void *userp)
+{
+	pthread_mutex_lock(&curlshare_lock[data]);
+}
+
+static void curlshare_unlockfn(CURL *curl, curl_lock_data data, void *userp)
+{
+	pthread_mutex_unlock(&curlshare_lock[data]);
+}
+
+static size_t curl_writefn(char *ptr, size_t size, size_t nmemb, void *userp)
+{
+	struct curl_transfer *prog = userp;
+	size_t nwritten = fwrite(ptr, size, nmemb, prog->localf);
+
+	if(prog->hashing) {
+		sums_update(prog->sums, ptr, nwritten * size);
+	}
+	return(nwritten * size);
+}
+
+static int curl_progressfn(void *userp, curl_off_t dltotal, curl_off_t dlnow,
+		curl_off_t ultotal, curl_off_t ulnow)
+{
+	struct curl_transfer *prog = userp;
+
+	/* nothing is known about the file until the headers are in */
+	if(handle->dlcb == NULL || dltotal == 0) {
+		return(0);
+	}
+
+	/* Progress 0 - initialize */
+	if(!prog->initialized) {
+		_alam_dlcb(prog->filename, 0, prog->offset + dltotal);
+		prog->initialized = 1;
+	}
+	_alam_dlcb(prog->filename, prog->offset + dlnow, prog->offset + dltotal);
+
+	return(0);
+}
+
+/* options common to all transfers */
+static void curl_setup(CURL *curl, const char *url, char *errbuf)
+{
+	errbuf[0] = '\0';
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_SHARE, curlshare);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	/* prefer HTTP/2 where the mirror offers it */
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+	/* 10s timeout, matching the libfetch downloader */
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+	curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 10L);
+}
+
+static int download_internal(const char *url, const char *localpath,
+		time_t mtimeold, time_t *mtimenew) {
+	CURL *curl;
+	CURLcode res;
+	FILE *localf = NULL;
+	struct stat st;
+	struct curl_transfer prog;
+	char *tempfile, *destfile, *filename;
+	char errbuf[CURL_ERROR_SIZE];
+	long unmet = 0, remotetime = -1;
+	int ret = -1;
+
+	filename = get_filename(url);
+	if(!filename) {
+		return(-1);
+	}
+
+	curl = curl_easy_init();
+	if(curl == NULL) {
+		RET_ERR(AM_ERR_LIBCURL, -1);
+	}
+
+	destfile = get_destfile(localpath, filename);
+	tempfile = get_tempfile(localpath, filename);
+
+	/* pass the raw filename for passing to the callback function */
+	_alam_log(AM_LOG_DEBUG, "using '%s' for download progress\n", filename);
+
+	memset(&prog, 0, sizeof(prog));
+	prog.filename = filename;
+
+	if(stat(tempfile, &st) == 0 && st.st_size > 0) {
+		_alam_log(AM_LOG_DEBUG, "existing file found, using it\n");
+		prog.offset = st.st_size;
+		localf = fopen(tempfile, "ab");
+	} else {
+		localf = fopen(tempfile, "wb");
+		if(mtimeold == 0 && mtimenew == NULL) {
+			prog.hashing = sums_start(prog.sums);
+		}
+	}
+	if(localf == NULL) {
+		_alam_log(AM_LOG_ERROR, _("cannot write to file '%s'\n"), tempfile);
+		goto cleanup;
+	}
+	prog.localf = localf;
+
+	curl_setup(curl, url, errbuf);
+	curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_writefn);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &prog);
+	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+	curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, curl_progressfn);
+	curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &prog);
+	curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)prog.offset);
+	if(mtimeold) {
+		curl_easy_setopt(curl, CURLOPT_TIMECONDITION, CURL_TIMECOND_IFMODSINCE);
+		curl_easy_setopt(curl, CURLOPT_TIMEVALUE, (long)mtimeold);
+	}
+
+	res = curl_easy_perform(curl);
+
+	if(res == CURLE_RANGE_ERROR) {
+		_alam_log(AM_LOG_WARNING, _("cannot resume download, starting over\n"));
+		localf = freopen(tempfile, "wb", localf);
+		if(localf == NULL) {
+			_alam_log(AM_LOG_ERROR, _("cannot write to file '%s'\n"), tempfile);
+			goto cleanup;
+		}
+		prog.localf = localf;
+		prog.offset = 0;
+		prog.initialized = 0;
+		if(prog.hashing) {
+			sums_abort(prog.sums);
+			prog.hashing = 0;
+		}
+		if(mtimeold == 0 && mtimenew == NULL) {
+			prog.hashing = sums_start(prog.sums);
+		}
+		errbuf[0] = '\0';
+		curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)0);
+		res = curl_easy_perform(curl);
+	}
+
+	if(res != CURLE_OK) {
+		am_errno = AM_ERR_LIBCURL;
+		_alam_log(AM_LOG_ERROR, _("failed retrieving file '%s' : %s\n"),
+				filename, errbuf[0] ? errbuf : curl_easy_strerror(res));
+		goto cleanup;
+	}
+
+	curl_easy_getinfo(curl, CURLINFO_CONDITION_UNMET, &unmet);
+	if(unmet) {
+		_alam_log(AM_LOG_DEBUG, "mtimes are identical, skipping %s\n", filename);
+		fclose(localf);
+		localf = NULL;
+		/* don't leave an empty partial file behind */
+		if(prog.offset == 0) {
+			unlink(tempfile);
+		}
+		ret = 1;
+		goto cleanup;
+	}
+
+	curl_easy_getinfo(curl, CURLINFO_FILETIME, &remotetime);
+	if(remotetime != -1 && mtimenew) {
+		*mtimenew = (time_t)remotetime;
+	}
+
+	if(fclose(localf) != 0) {
+		localf = NULL;
+		_alam_log(AM_LOG_ERROR, _("error writing to file '%s': %s\n"),
+				destfile, strerror(errno));
+		goto cleanup;
+	}
+	localf = NULL;
+
+	rename(tempfile, destfile);
+	if(prog.hashing) {
+		sums_store(prog.sums, destfile);
+		prog.hashing = 0;
+	}
+	ret = 0;
+
+cleanup:
+	if(prog.hashing) {
+		sums_abort(prog.sums);
+	}
+	FREE(tempfile);
+	FREE(destfile);
+	if(localf != NULL) {
+		fclose(localf);
+	}
+	curl_easy_cleanup(curl);
+	return(ret);
+}
+
+/* Range requests only exist for http; file and ftp servers are skipped. */
+static int is_http(const char *server)
+{
+	return(strncmp(server, "http://", 7) == 0
+			|| strncmp(server, "https://", 8) == 0);
+}
+
+static void split_launch(struct curl_split *split);
+
+static size_t segment_write(char *ptr, size_t size, size_t nmemb, void *userp)
+{
+	struct curl_segment *seg = userp;
+	struct curl_split *split = seg->split;
+	size_t len = size * nmemb;
+
+	/* a helper must get exactly its range, never the whole file */
+	if(seg != split->segs) {
+		long code = 0;
+		curl_easy_getinfo(seg->curl, CURLINFO_RESPONSE_CODE, &code);
+		if(code != 206) {
+			return(0);
+		}
+	}
+	if(seg->end != -1 && seg->pos + (off_t)len > seg->end + 1) {
+		return(0);
+	}
+	if(pwrite(split->fd, ptr, len, seg->pos) != (ssize_t)len) {
+		return(0);
+	}
+	seg->pos += len;
+	/* the first range is the only one written in order */
+	if(seg == split->segs && split->hashing) {
+		sums_update(split->sums, ptr, len);
+		split->hashed = seg->pos;
+	}
+
+	pthread_mutex_lock(&split->lock);
+	split->done += len;
+	_alam_dlcb(split->filename, split->done, split->total);
+	pthread_mutex_unlock(&split->lock);
+
+	return(len);
+}
+
+/* Reads the size of the file from the reply to the first range, and starts
+ * the other segments as soon as it is known. */
+static size_t segment_header(char *buffer, size_t size, size_t nitems, void *userp)
+{
+	struct curl_segment *seg = userp;
+	struct curl_split *split = seg->split;
+	size_t len = size * nitems;
+	char line[256];
+	intmax_t first, last, total;
+
+	if(len >= sizeof(line)) {
+		return(len);
+	}
+	memcpy(line, buffer, len);
+	line[len] = '\0';
+
+	if(strncmp(line, "HTTP/", 5) == 0) {
+		/* a new reply, e.g. after a redirect */
+		char *code = strchr(line, ' ');
+		split->whole = (code && atoi(code + 1) == 200);
+		split->total = -1;
+	} else if(strncasecmp(line, "Content-Range: bytes ", 21) == 0) {
+		if(sscanf(line + 21, "%jd-%jd/%jd", &first, &last, &total) == 3) {
+			seg->end = (off_t)last;
+			split->total = (off_t)total;
+		}
+	} else if(split->whole && strncasecmp(line, "Content-Length:", 15) == 0) {
+		/* the server ignored the range and sends the whole file */
+		seg->end = -1;
+		split->total = (off_t)strtoll(line + 15, NULL, 10);
+	} else if(strcmp(line, "\r\n") == 0 && split->total > 0) {
+		_alam_dlcb(split->filename, 0, split->total);
+		if(!split->whole && seg->end + 1 < split->total) {
+			split_launch(split);
+		}
+	}
+
+	return(len);
+}
+
+static int segment_fetch(struct curl_segment *seg)
+{
+	struct curl_split *split = seg->split;
+	struct timeval start, end;
+	off_t from = seg->pos;
+	char errbuf[CURL_ERROR_SIZE];
+	char range[64];
+	char *url;
+	CURLcode res;
+	int ret = 0;
+
+	url = get_fileurl(seg->server, split->filename);
+	if(url == NULL) {
+		return(-1);
+	}
+	seg->curl = curl_easy_init();
+	if(seg->curl == NULL) {
+		FREE(url);
+		return(-1);
+	}
+
+	curl_setup(seg->curl, url, errbuf);
+	snprintf(range, sizeof(range), "%jd-%jd", (intmax_t)seg->pos, (intmax_t)seg->end);
+	curl_easy_setopt(seg->curl, CURLOPT_RANGE, range);
+	curl_easy_setopt(seg->curl, CURLOPT_WRITEFUNCTION, segment_write);
+	curl_easy_setopt(seg->curl, CURLOPT_WRITEDATA, seg);
+	if(seg == split->segs) {
+		curl_easy_setopt(seg->curl, CURLOPT_HEADERFUNCTION, segment_header);
+		curl_easy_setopt(seg->curl, CURLOPT_HEADERDATA, seg);
+	}
+
+	gettimeofday(&start, NULL);
+	res = curl_easy_perform(seg->curl);
+	gettimeofday(&end, NULL);
+	if(res != CURLE_OK) {
+		_alam_log(AM_LOG_DEBUG, "range %s of %s from %s failed: %s\n", range,
+				split->filename, seg->server, errbuf[0] ? errbuf : curl_easy_strerror(res));
+	}
+
+	curl_easy_cleanup(seg->curl);
+	seg->curl = NULL;
+	FREE(url);
+
+	if(res != CURLE_OK || (seg->end != -1 && seg->pos != seg->end + 1)) {
+		ret = -1;
+	}
+	if(handle->rankmirrors) {
+		double elapsed = (end.tv_sec - start.tv_sec)
+			+ (end.tv_usec - start.tv_usec) / 1000000.0;
+		/* the first range runs alongside the threads it started */
+		int shared = (seg == split->segs) ? split->threads > 0 : seg->started;
+		_alam_mirror_record(seg->server, elapsed, seg->pos - from, ret, shared);
+	}
+	return(ret);
+}
+
+static void *segment_thread(void *data)
+{
+	struct curl_segment *seg = data;
+	seg->ret = segment_fetch(seg);
+	return(NULL);
+}
+
+/* Split what follows the first range among the other servers, one
+ * contiguous piece each, and start fetching them. */
+static void split_launch(struct curl_split *split)
+{
+	struct curl_segment *first = split->segs;
+	alam_list_t *i = split->servers->next;
+	off_t from = first->end + 1;
+	off_t rest = split->total - from;
+	off_t chunk;
+	int n, k;
+
+	/* reserve the whole file up front so segments land in place */
+	if(posix_fallocate(split->fd, 0, split->total) != 0) {
+		if(ftruncate(split->fd, split->total) != 0) {
+			return;
+		}
+	}
+
+	n = rest / handle->segmentsize;
+	if(n < 1) {
+		/* too small to be worth another server: the rest is left to the
+		 * first one, once its range is done */
+		_alam_log(AM_LOG_DEBUG, "fetching %s from one server\n", split->filename);
+		split->segs[1].split = split;
+		split->segs[1].pos = from;
+		split->segs[1].end = split->total - 1;
+		split->segs[1].ret = -1;
+		split->nsegs = 2;
+		return;
+	}
+	if(n > alam_list_count(i)) {
+		n = alam_list_count(i);
+	}
+	chunk = rest / n;
+
+	_alam_log(AM_LOG_DEBUG, "fetching %s in %d more segments\n",
+			split->filename, n);
+
+	for(k = 1; k <= n; k++, i = i->next) {
+		struct curl_segment *seg = &split->segs[k];
+		seg->split = split;
+		seg->server = i->data;
+		seg->pos = from + (k - 1) * chunk;
+		seg->end = (k == n) ? split->total - 1 : seg->pos + chunk - 1;
+		seg->ret = -1;
+		if(pthread_create(&seg->thread, NULL, segment_thread, seg) == 0) {
+			seg->started = 1;
+			split->threads++;
+		}
+	}
+	split->nsegs = n + 1;
+}
+
+/* Feeds the sums what the first range did not cover, reading back what
+ * the other servers wrote while it is still in the page cache. */
+static int split_hash_rest(struct curl_split *split, off_t size)
+{
+	char buf[64 * 1024];
+	off_t pos = split->hashed;
+
+	while(pos < size) {
+		size_t len = (size - pos) < (off_t)sizeof(buf) ? (size_t)(size - pos) : sizeof(buf);
+		ssize_t n = pread(split->fd, buf, len, pos);
+		if(n <= 0) {
+			return(-1);
+		}
+		sums_update(split->sums, buf, (size_t)n);
+		pos += n;
+	}
+	return(0);
+}
+
+/*
+ * Download filename in byte ranges from several http servers at once.
+ *
+ * RETURN:  0 for successful download
+ *          1 if the file is not worth splitting or can't be split
+ *         -1 on error
+ */
+static int download_segmented(const char *filename,
+		alam_list_t *servers, const char *localpath)
+{
+	struct curl_split split;
+	struct stat st;
+	alam_list_t *i, *http = NULL;
+	char *tempfile = NULL, *destfile = NULL;
+	int k, ret = 1;
+
+	for(i = servers; i; i = i->next) {
+		if(is_http(i->data)) {
+			http = alam_list_add(http, i->data);
+		}
+	}
+	if(alam_list_count(http) < 2) {
+		alam_list_free(http);
+		return(1);
+	}
+
+	destfile = get_destfile(localpath, filename);
+	tempfile = get_tempfile(localpath, filename);
+	if(destfile == NULL || tempfile == NULL) {
+		ret = -1;
+		goto cleanup;
+	}
+	/* leave an interrupted download to the resume logic */
+	if(stat(tempfile, &st) == 0 && st.st_size > 0) {
+		goto cleanup;
+	}
+
+	memset(&split, 0, sizeof(split));
+	split.filename = filename;
+	split.servers = http;
+	split.total = -1;
+	CALLOC(split.segs, alam_list_count(http), sizeof(struct curl_segment),
+			ret = -1; goto cleanup);
+	split.fd = open(tempfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(split.fd == -1) {
+		_alam_log(AM_LOG_ERROR, _("cannot write to file '%s'\n"), tempfile);
+		FREE(split.segs);
+		ret = -1;
+		goto cleanup;
+	}
+	pthread_mutex_init(&split.lock, NULL);
+	split.hashing = sums_start(split.sums);
+
+	/* the first range tells how large the file is */
+	split.nsegs = 1;
+	split.segs[0].split = &split;
+	split.segs[0].server = http->data;
+	split.segs[0].end = handle->segmentsize - 1;
+	split.segs[0].ret = segment_fetch(&split.segs[0]);
+
+	ret = split.segs[0].ret;
+	for(k = 1; k < split.nsegs; k++) {
+		struct curl_segment *seg = &split.segs[k];
+		if(seg->started) {
+			pthread_join(seg->thread, NULL);
+			seg->started = 0;
+		}
+		/* whatever a helper could not get comes from the first server */
+		if(ret == 0 && seg->ret != 0) {
+			seg->server = http->data;
+			seg->ret = segment_fetch(seg);
+		}
+		if(seg->ret != 0) {
+			ret = -1;
+		}
+	}
+
+	if(ret == 0 && split.total > 0 && lseek(split.fd, 0, SEEK_END) != split.total) {
+		_alam_log(AM_LOG_ERROR, _("%s appears to be truncated: %jd/%jd bytes\n"),
+				filename, (intmax_t)lseek(split.fd, 0, SEEK_END), (intmax_t)split.total);
+		ret = -1;
+	}
+	if(ret == 0 && split.hashing
+			&& split_hash_rest(&split, lseek(split.fd, 0, SEEK_END)) != 0) {
+		sums_abort(split.sums);
+		split.hashing = 0;
+	}
+	if(close(split.fd) != 0) {
+		ret = -1;
+	}
+	pthread_mutex_destroy(&split.lock);
+	FREE(split.segs);
+
+	if(ret == 0) {
+		rename(tempfile, destfile);
+		if(split.hashing) {
+			sums_store(split.sums, destfile);
+		}
+	} else {
+		if(split.hashing) {
+			sums_abort(split.sums);
+		}
+		/* a sparse file can't be resumed from, start over next time */
+		unlink(tempfile);
+		ret = -1;
+	}
+
+cleanup:
+	FREE(tempfile);
+	FREE(destfile);
+	alam_list_free(http);
+	return(ret);
+}
+#elif defined(INTERNAL_DOWNLOAD)
 static int download_internal(const char *url, const char *localpath,
 		time_t mtimeold, time_t *mtimenew) {
 	fetchIO *dlf = NULL;
@@ -88,6 +739,8 @@ static int download_internal(const char *url, const char *localpath,
 	struct sigaction new_action, old_action;
 	struct url *fileurl;
 	char buffer[AM_DLBUF_LEN];
+	amhash_t sums[2];
+	int hashing = 0;
 
 	filename = get_filename(url);
 	if(!filename) {
@@ -184,12 +837,13 @@ static int download_internal(const char *url, const char *localpath,
 			ret = -1;
 			goto cleanup;
 		}
+		if(mtimeold == 0 && mtimenew == NULL) {
+			hashing = sums_start(sums);
+		}
 	}
 
 	/* Progress 0 - initialize */
-	if(handle->dlcb) {
-		handle->dlcb(filename, 0, ust.size);
-	}
+	_alam_dlcb(filename, 0, ust.size);
 
 	while((nread = fetchIO_read(dlf, buffer, AM_DLBUF_LEN)) > 0) {
 		size_t nwritten = 0;
@@ -201,10 +855,11 @@ static int download_internal(const char *url, const char *localpath,
 			goto cleanup;
 		}
 		dl_thisfile += nread;
-
-		if(handle->dlcb) {
-			handle->dlcb(filename, dl_thisfile, ust.size);
+		if(hashing) {
+			sums_update(sums, buffer, nread);
 		}
+
+		_alam_dlcb(filename, dl_thisfile, ust.size);
 	}
 
 	/* did the transfer complete normally? */
@@ -225,12 +880,20 @@ static int download_internal(const char *url, const char *localpath,
 	dlf = NULL;
 
 	rename(tempfile, destfile);
+	if(hashing) {
+		sums_store(sums, destfile);
+		hashing = 0;
+	}
 	ret = 0;
 
 cleanup:
 	/* restore any existing SIGPIPE signal handler */
 	sigaction(SIGPIPE, &old_action, NULL);
 
+	if(hashing) {
+		sums_abort(sums);
+	}
+
 	FREE(tempfile);
 	FREE(destfile);
 	if(localf != NULL) {
@@ -246,8 +909,19 @@ cleanup:
 
 static int download(const char *url, const char *localpath,
 		time_t mtimeold, time_t *mtimenew) {
+	char *filename = get_filename(url);
+
+	/* stored checksums only hold for the file they were computed from */
+	if(filename) {
+		char *destfile = get_destfile(localpath, filename);
+		if(destfile) {
+			_alam_checksum_forget(destfile);
+			FREE(destfile);
+		}
+	}
+
 	if(handle->fetchcb == NULL) {
-#if defined(INTERNAL_DOWNLOAD)
+#if defined(INTERNAL_DOWNLOAD) || defined(CURL_DOWNLOAD)
 		return(download_internal(url, localpath, mtimeold, mtimenew));
 #else
 		RET_ERR(AM_ERR_EXTERNAL_DOWNLOAD, -1);
@@ -261,6 +935,128 @@ static int download(const char *url, const char *localpath,
 	}
 }
 
+int _alam_dload_init(void)
+{
+#if defined(CURL_DOWNLOAD)
+	int i;
+
+	if(curl_global_init(CURL_GLOBAL_ALL) != 0) {
+		RET_ERR(AM_ERR_LIBCURL, -1);
+	}
+	curlshare = curl_share_init();
+	if(curlshare == NULL) {
+		curl_global_cleanup();
+		RET_ERR(AM_ERR_LIBCURL, -1);
+	}
+	for(i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		pthread_mutex_init(&curlshare_lock[i], NULL);
+	}
+	curl_share_setopt(curlshare, CURLSHOPT_LOCKFUNC, curlshare_lockfn);
+	curl_share_setopt(curlshare, CURLSHOPT_UNLOCKFUNC, curlshare_unlockfn);
+	curl_share_setopt(curlshare, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	curl_share_setopt(curlshare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(curlshare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#endif
+	return(0);
+}
+
+void _alam_dload_release(void)
+{
+#if defined(CURL_DOWNLOAD)
+	int i;
+
+	if(curlshare == NULL) {
+		return;
+	}
+	curl_share_cleanup(curlshare);
+	curlshare = NULL;
+	for(i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		pthread_mutex_destroy(&curlshare_lock[i]);
+	}
+	curl_global_cleanup();
+#endif
+}
+
+/* Download filename from one server, recording how long it took when
+ * mirrors are ranked. q is the queue the download is part of, if any. */
+static int download_from(const char *server, const char *filename,
+		const char *localpath, time_t mtimeold, time_t *mtimenew,
+		struct dload_queue *q)
+{
+	struct timeval start, end;
+	char *fileurl;
+	unsigned int first = 0;
+	int shared = 0;
+	int ret;
+
+	fileurl = get_fileurl(server, filename);
+	if(fileurl == NULL) {
+		return(-1);
+	}
+
+	/* the link was shared if another transfer was running when this one
+	 * started, or started before it was done */
+	if(q) {
+		pthread_mutex_lock(&q->lock);
+		shared = (q->inflight > 0);
+		q->inflight++;
+		first = ++q->started;
+		pthread_mutex_unlock(&q->lock);
+	}
+	gettimeofday(&start, NULL);
+	ret = download(fileurl, localpath, mtimeold, mtimenew);
+	gettimeofday(&end, NULL);
+	FREE(fileurl);
+	if(q) {
+		pthread_mutex_lock(&q->lock);
+		q->inflight--;
+		shared = shared || (q->started != first);
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	if(handle->rankmirrors) {
+		struct stat st;
+		off_t size = 0;
+		double elapsed = (end.tv_sec - start.tv_sec)
+			+ (end.tv_usec - start.tv_usec) / 1000000.0;
+		char *destfile = get_destfile(localpath, filename);
+
+		if(ret == 0 && destfile && stat(destfile, &st) == 0) {
+			size = st.st_size;
+		}
+		FREE(destfile);
+		_alam_mirror_record(server, elapsed, size, ret, shared);
+	}
+
+	return(ret);
+}
+
+static int download_servers(const char *filename,
+		alam_list_t *servers, const char *localpath,
+		time_t mtimeold, time_t *mtimenew)
+{
+	alam_list_t *i;
+	int ret = -1;
+
+#if defined(CURL_DOWNLOAD)
+	if(handle->fetchcb == NULL && handle->segmentsize > 0
+			&& mtimeold == 0 && mtimenew == NULL
+			&& download_segmented(filename, servers, localpath) == 0) {
+		return(0);
+	}
+#endif
+
+	for(i = servers; i; i = i->next) {
+		ret = download_from(i->data, filename, localpath, mtimeold, mtimenew,
+				NULL);
+		if(ret != -1) {
+			break;
+		}
+	}
+
+	return(ret);
+}
+
 /*
  * Download a single file
  *   - if mtimeold is non-NULL, then only download the file if it's different
@@ -277,23 +1073,45 @@ int _alam_download_single_file(const char *filename,
 		alam_list_t *servers, const char *localpath,
 		time_t mtimeold, time_t *mtimenew)
 {
-	alam_list_t *i;
-	int ret = -1;
+	int ret;
 
 	ASSERT(servers != NULL, RET_ERR(AM_ERR_SERVER_NONE, -1));
 
-	for(i = servers; i; i = i->next) {
-		const char *server = i->data;
-		char *fileurl = NULL;
-		int len;
+	if(handle->rankmirrors) {
+		alam_list_t *ranked = _alam_mirror_rank(servers);
+		ret = download_servers(filename, ranked, localpath, mtimeold, mtimenew);
+		alam_list_free(ranked);
+	} else {
+		ret = download_servers(filename, servers, localpath, mtimeold, mtimenew);
+	}
 
-		/* print server + filename into a buffer */
-		len = strlen(server) + strlen(filename) + 2;
-		CALLOC(fileurl, len, sizeof(char), RET_ERR(AM_ERR_MEMORY, -1));
-		snprintf(fileurl, len, "%s/%s", server, filename);
+	return(ret);
+}
+
+/* Same as _alam_download_single_file(), but waits for a free connection
+ * slot on each server before using it. */
+static int queue_fetch(struct dload_queue *q, const char *filename)
+{
+	alam_list_t *i;
+	int idx, ret = -1;
+
+	/* files are not split among servers here: the queue already keeps
+	 * several of them busy, within the per-server limit */
+	for(i = q->servers, idx = 0; i; i = i->next, idx++) {
+		pthread_mutex_lock(&q->lock);
+		while(q->maxconns > 0 && q->active[idx] >= q->maxconns) {
+			pthread_cond_wait(&q->slotfree, &q->lock);
+		}
+		q->active[idx]++;
+		pthread_mutex_unlock(&q->lock);
+
+		ret = download_from(i->data, filename, q->localpath, 0, NULL, q);
+
+		pthread_mutex_lock(&q->lock);
+		q->active[idx]--;
+		pthread_cond_broadcast(&q->slotfree);
+		pthread_mutex_unlock(&q->lock);
 
-		ret = download(fileurl, localpath, mtimeold, mtimenew);
-		FREE(fileurl);
 		if(ret != -1) {
 			break;
 		}
@@ -302,21 +1120,122 @@ int _alam_download_single_file(const char *filename,
 	return(ret);
 }
 
+static void *queue_worker(void *data)
+{
+	struct dload_queue *q = data;
+
+	while(1) {
+		const char *filename;
+
+		pthread_mutex_lock(&q->lock);
+		if(q->next == NULL) {
+			pthread_mutex_unlock(&q->lock);
+			break;
+		}
+		filename = q->next->data;
+		q->next = q->next->next;
+		pthread_mutex_unlock(&q->lock);
+
+		if(queue_fetch(q, filename) == -1) {
+			pthread_mutex_lock(&q->lock);
+			q->errors++;
+			pthread_mutex_unlock(&q->lock);
+		}
+	}
+
+	return(NULL);
+}
+
+/* Run the queue on nworkers threads, the calling thread included. */
+static int queue_run(struct dload_queue *q, int nworkers)
+{
+	pthread_t *workers = NULL;
+	int started = 0, i;
+
+	CALLOC(q->active, alam_list_count(q->servers), sizeof(int),
+			RET_ERR(AM_ERR_MEMORY, -1));
+	CALLOC(workers, nworkers - 1, sizeof(pthread_t),
+			FREE(q->active); RET_ERR(AM_ERR_MEMORY, -1));
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->slotfree, NULL);
+
+	for(i = 0; i < nworkers - 1; i++) {
+		if(pthread_create(&workers[started], NULL, queue_worker, q) == 0) {
+			started++;
+		}
+	}
+	_alam_log(AM_LOG_DEBUG, "downloading with %d parallel transfers\n",
+			started + 1);
+
+	/* the calling thread takes its share of the queue as well */
+	queue_worker(q);
+	for(i = 0; i < started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	pthread_cond_destroy(&q->slotfree);
+	pthread_mutex_destroy(&q->lock);
+	FREE(workers);
+	FREE(q->active);
+
+	return(0);
+}
+
+/*
+ * Download a list of files, up to handle->paralleldl at a time and no more
+ * than handle->mirrorconns at a time from the same server.
+ *
+ * RETURN:  the number of files that could not be retrieved
+ */
 int _alam_download_files(alam_list_t *files,
 		alam_list_t *servers, const char *localpath)
 {
-	int ret = 0;
-	alam_list_t *lp;
+	struct dload_queue q;
+	alam_list_t *ranked = NULL;
+	int nworkers;
+
+	ASSERT(servers != NULL,
+			RET_ERR(AM_ERR_SERVER_NONE, alam_list_count(files)));
 
-	for(lp = files; lp; lp = lp->next) {
-		char *filename = lp->data;
-		if(_alam_download_single_file(filename, servers,
-					localpath, 0, NULL) == -1) {
-			ret++;
+	if(handle->rankmirrors) {
+		ranked = _alam_mirror_rank(servers);
+		servers = ranked;
+	}
+
+	nworkers = alam_list_count(files);
+	if(nworkers > handle->paralleldl) {
+		nworkers = handle->paralleldl;
+	}
+#if !defined(CURL_DOWNLOAD)
+	/* libfetch keeps its error state in globals, so the internal
+	 * downloader always runs one transfer at a time */
+	if(handle->fetchcb == NULL) {
+		nworkers = 1;
+	}
+#endif
+
+	memset(&q, 0, sizeof(q));
+	q.next = files;
+	q.servers = servers;
+	q.localpath = localpath;
+	q.maxconns = handle->mirrorconns;
+
+	if(nworkers <= 1) {
+		alam_list_t *lp;
+
+		for(lp = files; lp; lp = lp->next) {
+			char *filename = lp->data;
+			if(download_servers(filename, servers, localpath, 0, NULL) == -1) {
+				q.errors++;
+			}
 		}
+	} else if(queue_run(&q, nworkers) == -1) {
+		q.errors = alam_list_count(files);
 	}
 
-	return(ret);
+	alam_list_free(ranked);
+
+	return(q.errors);
 }
 
 /** Fetch a remote pkg.
@@ -27,6 +27,10 @@
 
 #define AM_DLBUF_LEN (1024 * 10)
 
+/* set up and tear down the state kept across downloads */
+int _alam_dload_init(void);
+void _alam_dload_release(void);
+
 int _alam_download_single_file(const char *filename,
 		alam_list_t *servers, const char *localpath,
 		time_t mtimeold, time_t *mtimenew);
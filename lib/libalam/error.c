@@ -150,6 +150,9 @@ const char SYMEXPORT *alam_strerror(int err)
 			/* obviously shouldn't get here... */
 			return _("download library error");
 #endif
+		case AM_ERR_LIBCURL:
+			/* the libcurl error is logged with the failing transfer */
+			return _("libcurl error");
 		case AM_ERR_EXTERNAL_DOWNLOAD:
 			return _("error invoking external downloader");
 		/* Unknown error! */
@@ -38,6 +38,8 @@
 #include "log.h"
 #include "trans.h"
 #include "alam.h"
+#include "mirror.h"
+#include "checksum.h"
 
 /* global var for handle (private to libalam) */
 amhandle_t *handle = NULL;
@@ -79,8 +81,15 @@ void _alam_handle_free(amhandle_t *handle)
 	FREELIST(handle->cachedirs);
 	FREE(handle->logfile);
 	FREE(handle->lockfile);
+	FREE(handle->stagedir);
+	alam_list_free_inner(handle->mirrors, (alam_list_fn_free)_alam_mirror_free);
+	alam_list_free(handle->mirrors);
+	alam_list_free_inner(handle->checksums, (alam_list_fn_free)_alam_checksum_free);
+	alam_list_free(handle->checksums);
 	FREE(handle->arch);
 	FREELIST(handle->dbs_sync);
+	FREE(handle->pkgindex.entries);
+	FREE(handle->provindex.entries);
 	FREELIST(handle->noupgrade);
 	FREELIST(handle->noextract);
 	FREELIST(handle->ignorepkg);
@@ -223,6 +232,69 @@ const char SYMEXPORT *alam_option_get_arch()
 	return handle->arch;
 }
 
+unsigned short SYMEXPORT alam_option_get_paralleldownloads()
+{
+	if (handle == NULL) {
+		am_errno = AM_ERR_HANDLE_NULL;
+		return -1;
+	}
+	return handle->paralleldl;
+}
+
+unsigned short SYMEXPORT alam_option_get_maxmirrorconns()
+{
+	if (handle == NULL) {
+		am_errno = AM_ERR_HANDLE_NULL;
+		return -1;
+	}
+	return handle->mirrorconns;
+}
+
+unsigned short SYMEXPORT alam_option_get_rankmirrors()
+{
+	if (handle == NULL) {
+		am_errno = AM_ERR_HANDLE_NULL;
+		return -1;
+	}
+	return handle->rankmirrors;
+}
+
+off_t SYMEXPORT alam_option_get_segmentsize()
+{
+	if (handle == NULL) {
+		am_errno = AM_ERR_HANDLE_NULL;
+		return -1;
+	}
+	return handle->segmentsize;
+}
+
+unsigned short SYMEXPORT alam_option_get_streaminstall()
+{
+	if (handle == NULL) {
+		am_errno = AM_ERR_HANDLE_NULL;
+		return -1;
+	}
+	return handle->streaminstall;
+}
+
+const char SYMEXPORT *alam_option_get_stagedir()
+{
+	if (handle == NULL) {
+		am_errno = AM_ERR_HANDLE_NULL;
+		return NULL;
+	}
+	return handle->stagedir;
+}
+
+unsigned short SYMEXPORT alam_option_get_syncextract()
+{
+	if (handle == NULL) {
+		am_errno = AM_ERR_HANDLE_NULL;
+		return -1;
+	}
+	return handle->syncextract;
+}
+
 amdb_t SYMEXPORT *alam_option_get_localdb()
 {
 	if (handle == NULL) {
@@ -541,4 +613,60 @@ void SYMEXPORT alam_option_set_usedelta(unsigned short usedelta)
 	handle->usedelta = usedelta;
 }
 
+void SYMEXPORT alam_option_set_paralleldownloads(unsigned short paralleldl)
+{
+	handle->paralleldl = paralleldl;
+}
+
+void SYMEXPORT alam_option_set_maxmirrorconns(unsigned short mirrorconns)
+{
+	handle->mirrorconns = mirrorconns;
+}
+
+void SYMEXPORT alam_option_set_rankmirrors(unsigned short rankmirrors)
+{
+	handle->rankmirrors = rankmirrors;
+}
+
+void SYMEXPORT alam_option_set_segmentsize(off_t segmentsize)
+{
+	handle->segmentsize = segmentsize;
+}
+
+void SYMEXPORT alam_option_set_streaminstall(unsigned short streaminstall)
+{
+	handle->streaminstall = streaminstall;
+}
+
+int SYMEXPORT alam_option_set_stagedir(const char *stagedir)
+{
+	size_t len;
+
+	ALAM_LOG_FUNC;
+
+	if(stagedir && !strlen(stagedir)) {
+		am_errno = AM_ERR_WRONG_ARGS;
+		return(-1);
+	}
+	FREE(handle->stagedir);
+	if(stagedir == NULL) {
+		return(0);
+	}
+
+	/* verify stagedir ends in a '/' */
+	len = strlen(stagedir);
+	CALLOC(handle->stagedir, len + 2, sizeof(char), RET_ERR(AM_ERR_MEMORY, -1));
+	strcpy(handle->stagedir, stagedir);
+	if(stagedir[len - 1] != '/') {
+		handle->stagedir[len] = '/';
+	}
+	_alam_log(AM_LOG_DEBUG, "option 'stagedir' = %s\n", handle->stagedir);
+	return(0);
+}
+
+void SYMEXPORT alam_option_set_syncextract(unsigned short syncextract)
+{
+	handle->syncextract = syncextract;
+}
+
 /* vim: set ts=2 sw=2 noet: */
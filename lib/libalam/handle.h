@@ -28,11 +28,15 @@
 #include "log.h"
 #include "alam.h"
 #include "trans.h"
+#include "repoindex.h"
 
 typedef struct _amhandle_t {
 	/* internal usage */
 	amdb_t *db_local;       /* local db pointer */
 	alam_list_t *dbs_sync;  /* List of (pmdb_t *) */
+	unsigned int dbranks;   /* ranks handed out to sync dbs so far */
+	amrepoindex_t pkgindex;  /* sync packages by name, see repoindex.c */
+	amrepoindex_t provindex; /* sync packages by provision */
 	FILE *logstream;        /* log file stream pointer */
 	int lckfd;              /* lock file descriptor if one exists */
 	amtrans_t *trans;
@@ -60,6 +64,22 @@ typedef struct _amhandle_t {
 	unsigned short usesyslog;    /* Use syslog instead of logfile? */ /* TODO move to frontend */
 	char *arch;       /* Architecture of packages we should allow */
 	unsigned short usedelta;     /* Download deltas if possible */
+	unsigned short paralleldl;   /* Number of simultaneous downloads */
+	unsigned short mirrorconns;  /* Max simultaneous downloads per server, 0 for no limit */
+	unsigned short rankmirrors;  /* Try the fastest known server first */
+	off_t segmentsize;           /* Split larger downloads among servers, 0 to disable */
+	unsigned short streaminstall; /* Install new packages from a stage dir, not the cache */
+	char *stagedir;              /* Where streamed packages go, NULL for the cachedir */
+	unsigned short syncextract;  /* Sync extracted files before renaming them into place */
+
+	/* mirror scores, see mirror.c */
+	alam_list_t *mirrors;        /* List of (ammirror_t *) */
+	unsigned short mirrors_loaded;
+	unsigned short mirrors_changed; /* scores not saved yet */
+
+	/* checksums of cached files, see checksum.c */
+	alam_list_t *checksums;      /* List of (amchecksum_t *) */
+	unsigned short checksums_loaded;
 } amhandle_t;
 
 /* global handle variable */
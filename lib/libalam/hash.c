@@ -0,0 +1,193 @@
+/*
+ *  hash.c
+ *
+ *  Copyright (c) 2006-2009 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBCRYPTO
+#include <openssl/evp.h>
+#else
+#include "md5.h"
+#include "sha256.h"
+#endif
+
+/* libalam */
+#include "hash.h"
+#include "util.h"
+#include "log.h"
+#include "alam.h"
+
+/* read size used by _alam_hash_file(), a multiple of the page size */
+#define HASH_FILE_BUFSIZE (256 * 1024)
+/* largest digest we produce (SHA-256) */
+#define HASH_MAXLEN 32
+
+static const size_t hash_len[] = { 16, 32 };
+
+const char *_alam_hash_name(amhashtype_t type)
+{
+	return(type == AM_HASH_SHA256 ? "sha256" : "md5");
+}
+
+/* Convert a digest to its hex string. */
+static char *hash_tostring(const unsigned char *digest, size_t len)
+{
+	char *str;
+	size_t i;
+
+	CALLOC(str, len * 2 + 1, sizeof(char), RET_ERR(AM_ERR_MEMORY, NULL));
+	for(i = 0; i < len; i++) {
+		/* sprintf is acceptable here because we know our output */
+		sprintf(str + (i * 2), "%02x", digest[i]);
+	}
+	return(str);
+}
+
+int _alam_hash_init(amhash_t *hash, amhashtype_t type)
+{
+	hash->type = type;
+#ifdef HAVE_LIBCRYPTO
+	hash->ctx = EVP_MD_CTX_create();
+	if(hash->ctx == NULL) {
+		RET_ERR(AM_ERR_MEMORY, -1);
+	}
+	if(!EVP_DigestInit_ex(hash->ctx,
+				type == AM_HASH_SHA256 ? EVP_sha256() : EVP_md5(), NULL)) {
+		EVP_MD_CTX_destroy(hash->ctx);
+		hash->ctx = NULL;
+		return(-1);
+	}
+#else
+	if(type == AM_HASH_SHA256) {
+		MALLOC(hash->ctx, sizeof(sha256_context), RET_ERR(AM_ERR_MEMORY, -1));
+		sha256_starts(hash->ctx);
+	} else {
+		MALLOC(hash->ctx, sizeof(md5_context), RET_ERR(AM_ERR_MEMORY, -1));
+		md5_starts(hash->ctx);
+	}
+#endif
+	return(0);
+}
+
+void _alam_hash_update(amhash_t *hash, const void *buf, size_t len)
+{
+#ifdef HAVE_LIBCRYPTO
+	EVP_DigestUpdate(hash->ctx, buf, len);
+#else
+	if(hash->type == AM_HASH_SHA256) {
+		sha256_update(hash->ctx, (unsigned char *)buf, (int)len);
+	} else {
+		md5_update(hash->ctx, (unsigned char *)buf, (int)len);
+	}
+#endif
+}
+
+/* Finish the checksum and return it as a hex string. */
+char *_alam_hash_final(amhash_t *hash)
+{
+	unsigned char digest[HASH_MAXLEN];
+
+#ifdef HAVE_LIBCRYPTO
+	int ok = EVP_DigestFinal_ex(hash->ctx, digest, NULL);
+	EVP_MD_CTX_destroy(hash->ctx);
+	hash->ctx = NULL;
+	if(!ok) {
+		return(NULL);
+	}
+#else
+	if(hash->type == AM_HASH_SHA256) {
+		sha256_finish(hash->ctx, digest);
+	} else {
+		md5_finish(hash->ctx, digest);
+	}
+	FREE(hash->ctx);
+#endif
+	return(hash_tostring(digest, hash_len[hash->type]));
+}
+
+/* Drop a checksum that will not be finished. */
+void _alam_hash_abort(amhash_t *hash)
+{
+#ifdef HAVE_LIBCRYPTO
+	if(hash->ctx) {
+		EVP_MD_CTX_destroy(hash->ctx);
+		hash->ctx = NULL;
+	}
+#else
+	FREE(hash->ctx);
+#endif
+}
+
+/* Feed a file to update in large page aligned blocks, telling the kernel
+ * it is read sequentially. Returns 0 on success, -1 on error. */
+static int hash_read_file(const char *path,
+		void (*update)(void *data, const void *buf, size_t len), void *data)
+{
+	unsigned char *buf;
+	ssize_t n;
+	int fd;
+
+	if((fd = open(path, O_RDONLY)) == -1) {
+		return(-1);
+	}
+	if(posix_memalign((void **)&buf, 4096, HASH_FILE_BUFSIZE) != 0) {
+		close(fd);
+		return(-1);
+	}
+#if defined(POSIX_FADV_SEQUENTIAL)
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+	do {
+		n = read(fd, buf, HASH_FILE_BUFSIZE);
+		if(n > 0) {
+			update(data, buf, (size_t)n);
+		}
+	} while(n > 0 || (n == -1 && errno == EINTR));
+	free(buf);
+	close(fd);
+	return(n == -1 ? -1 : 0);
+}
+
+static void hash_file_update(void *data, const void *buf, size_t len)
+{
+	_alam_hash_update(data, buf, len);
+}
+
+/* Return the checksum of a file as a hex string, NULL on error. */
+char *_alam_hash_file(amhashtype_t type, const char *path)
+{
+	amhash_t hash;
+
+	if(_alam_hash_init(&hash, type) != 0) {
+		return(NULL);
+	}
+	if(hash_read_file(path, hash_file_update, &hash) != 0) {
+		_alam_hash_abort(&hash);
+		return(NULL);
+	}
+	return(_alam_hash_final(&hash));
+}
+
+/* vim: set ts=2 sw=2 noet: */
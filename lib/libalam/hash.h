@@ -0,0 +1,45 @@
+/*
+ *  hash.h
+ *
+ *  Copyright (c) 2006-2009 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ALAM_HASH_H
+#define _ALAM_HASH_H
+
+#include <sys/types.h>
+
+typedef enum _amhashtype_t {
+	AM_HASH_MD5 = 0,
+	AM_HASH_SHA256
+} amhashtype_t;
+
+/* running checksum, backed by libcrypto when available and by the
+ * bundled md5.c/sha256.c otherwise; ctx belongs to hash.c */
+typedef struct _amhash_t {
+	amhashtype_t type;
+	void *ctx;
+} amhash_t;
+
+int _alam_hash_init(amhash_t *hash, amhashtype_t type);
+void _alam_hash_update(amhash_t *hash, const void *buf, size_t len);
+char *_alam_hash_final(amhash_t *hash);
+void _alam_hash_abort(amhash_t *hash);
+char *_alam_hash_file(amhashtype_t type, const char *path);
+const char *_alam_hash_name(amhashtype_t type);
+
+#endif /* _ALAM_HASH_H */
+
+/* vim: set ts=2 sw=2 noet: */
@@ -26,6 +26,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
 
 /* libalam */
 #include "log.h"
@@ -33,6 +34,10 @@
 #include "util.h"
 #include "alam.h"
 
+/* library code may log and report progress from worker threads, the
+ * frontend callbacks are only ever called by one of them at a time */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /** \addtogroup alam_log Logging Functions
  * @brief Functions to log using libalam
  * @{
@@ -97,9 +102,26 @@ void _alam_log(amloglevel_t flag, char *fmt, ...)
 		return;
 	}
 
+	pthread_mutex_lock(&log_lock);
 	va_start(args, fmt);
 	logcb(flag, fmt, args);
 	va_end(args);
+	pthread_mutex_unlock(&log_lock);
+}
+
+/* Report download progress to the frontend. The calls for files fetched
+ * side by side interleave, as alam_cb_download documents. */
+void _alam_dlcb(const char *filename, off_t xfered, off_t total)
+{
+	alam_cb_download dlcb = alam_option_get_dlcb();
+
+	if(dlcb == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&log_lock);
+	dlcb(filename, xfered, total);
+	pthread_mutex_unlock(&log_lock);
 }
 
 /* vim: set ts=2 sw=2 noet: */
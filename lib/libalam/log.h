@@ -30,6 +30,7 @@
 #endif
 
 void _alam_log(amloglevel_t flag, char *fmt, ...) __attribute__((format(printf,2,3)));
+void _alam_dlcb(const char *filename, off_t xfered, off_t total);
 
 #endif /* _ALAM_LOG_H */
 
@@ -32,11 +32,10 @@
  *  * removal of HMAC code
  *  * removal of SELF_TEST code
  *  * removal of ipad and opad from the md5_context struct in md5.h
- *  * change of md5_file prototype from
- *        int md5_file( char *path, unsigned char *output )
- *      to
- *        int md5_file( const char *path, unsigned char *output )
+ *  * removal of md5_file, files are read by _alam_hash_file() in hash.c
  *  * various static/inline changes
+ *  * md5_starts, md5_update and md5_finish made public so downloads can
+ *    be hashed as they are written
  */
 
 #include <string.h>
@@ -70,7 +69,7 @@
 /*
  * MD5 context setup
  */
-static inline void md5_starts( md5_context *ctx )
+void md5_starts( md5_context *ctx )
 {
     ctx->total[0] = 0;
     ctx->total[1] = 0;
@@ -207,7 +206,7 @@ static inline void md5_process( md5_context *ctx, unsigned char data[64] )
 /*
  * MD5 process buffer
  */
-static inline void md5_update( md5_context *ctx, unsigned char *input, int ilen )
+void md5_update( md5_context *ctx, unsigned char *input, int ilen )
 {
     int fill;
     unsigned long left;
@@ -259,7 +258,7 @@ static unsigned char md5_padding[64] =
 /*
  * MD5 final digest
  */
-static inline void md5_finish( md5_context *ctx, unsigned char output[16] )
+void md5_finish( md5_context *ctx, unsigned char output[16] )
 {
     unsigned long last, padn;
     unsigned long high, low;
@@ -297,35 +296,3 @@ void md5( unsigned char *input, int ilen, unsigned char output[16] )
 
     memset( &ctx, 0, sizeof( md5_context ) );
 }
-
-/*
- * output = MD5( file contents )
- */
-int md5_file( const char *path, unsigned char output[16] )
-{
-    FILE *f;
-    size_t n;
-    md5_context ctx;
-    unsigned char buf[1024];
-
-    if( ( f = fopen( path, "rb" ) ) == NULL )
-        return( 1 );
-
-    md5_starts( &ctx );
-
-    while( ( n = fread( buf, 1, sizeof( buf ), f ) ) > 0 )
-        md5_update( &ctx, buf, (int) n );
-
-    md5_finish( &ctx, output );
-
-    memset( &ctx, 0, sizeof( md5_context ) );
-
-    if( ferror( f ) != 0 )
-    {
-        fclose( f );
-        return( 2 );
-    }
-
-    fclose( f );
-    return( 0 );
-}
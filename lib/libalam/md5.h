@@ -32,23 +32,36 @@ typedef struct
 md5_context;
 
 /**
- * \brief          Output = MD5( input buffer )
+ * \brief          MD5 context setup
+ *
+ * \param ctx      context to be initialized
+ */
+void md5_starts( md5_context *ctx );
+
+/**
+ * \brief          MD5 process buffer
  *
+ * \param ctx      MD5 context
  * \param input    buffer holding the  data
  * \param ilen     length of the input data
- * \param output   MD5 checksum result
  */
-void md5( unsigned char *input, int ilen, unsigned char output[16] );
+void md5_update( md5_context *ctx, unsigned char *input, int ilen );
 
 /**
- * \brief          Output = MD5( file contents )
+ * \brief          MD5 final digest
  *
- * \param path     input file name
+ * \param ctx      MD5 context
  * \param output   MD5 checksum result
+ */
+void md5_finish( md5_context *ctx, unsigned char output[16] );
+
+/**
+ * \brief          Output = MD5( input buffer )
  *
- * \return         0 if successful, 1 if fopen failed,
- *                 or 2 if fread failed
+ * \param input    buffer holding the  data
+ * \param ilen     length of the input data
+ * \param output   MD5 checksum result
  */
-int md5_file( const char *path, unsigned char output[16] );
+void md5( unsigned char *input, int ilen, unsigned char output[16] );
 
 #endif /* md5.h */
@@ -0,0 +1,330 @@
+/*
+ *  mirror.c
+ *
+ *  Copyright (c) 2006-2009 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* libalam */
+#include "mirror.h"
+#include "alam_list.h"
+#include "util.h"
+#include "log.h"
+#include "handle.h"
+
+/* weight of a new sample in the running averages */
+#define MIRROR_WEIGHT 0.3
+/* files below this size only tell us about latency */
+#define MIRROR_SMALLFILE (64 * 1024)
+/* size used to compare the expected speed of two mirrors */
+#define MIRROR_REFSIZE (1024 * 1024)
+
+/* downloads may record samples from several threads */
+static pthread_mutex_t mirror_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void _alam_mirror_free(ammirror_t *mirror)
+{
+	if(mirror == NULL) {
+		return;
+	}
+	FREE(mirror->url);
+	FREE(mirror);
+}
+
+static char *get_mirrorfile(void)
+{
+	char *file;
+	/* dbpath + 'mirrors' + NULL */
+	MALLOC(file, strlen(handle->dbpath) + 8, RET_ERR(AM_ERR_MEMORY, NULL));
+	sprintf(file, "%smirrors", handle->dbpath);
+	return(file);
+}
+
+static void mirror_load(void)
+{
+	FILE *fp;
+	char *file;
+	char line[PATH_MAX + 128];
+	char format[32];
+
+	if(handle->mirrors_loaded || handle->dbpath == NULL) {
+		return;
+	}
+	handle->mirrors_loaded = 1;
+
+	file = get_mirrorfile();
+	if(file == NULL || (fp = fopen(file, "r")) == NULL) {
+		FREE(file);
+		return;
+	}
+	/* the url has to fit in url[] whatever the file holds */
+	snprintf(format, sizeof(format), "%%%ds %%lf %%lf %%u", PATH_MAX - 1);
+	while(fgets(line, sizeof(line), fp)) {
+		ammirror_t *mirror;
+		char url[PATH_MAX];
+		double latency, rate;
+		unsigned int failures;
+
+		if(strchr(line, '\n') == NULL && !feof(fp)) {
+			/* drop the whole of an overlong line */
+			int c;
+			while((c = fgetc(fp)) != EOF && c != '\n');
+			continue;
+		}
+		if(sscanf(line, format, url, &latency, &rate, &failures) != 4) {
+			continue;
+		}
+		CALLOC(mirror, 1, sizeof(ammirror_t), goto cleanup);
+		STRDUP(mirror->url, url, FREE(mirror); goto cleanup);
+		mirror->latency = latency;
+		mirror->rate = rate;
+		mirror->failures = failures;
+		handle->mirrors = alam_list_add(handle->mirrors, mirror);
+	}
+
+cleanup:
+	fclose(fp);
+	FREE(file);
+	_alam_log(AM_LOG_DEBUG, "loaded %d mirror scores\n",
+			alam_list_count(handle->mirrors));
+}
+
+static ammirror_t *mirror_find(const char *url)
+{
+	alam_list_t *i;
+
+	for(i = handle->mirrors; i; i = i->next) {
+		ammirror_t *mirror = i->data;
+		if(strcmp(mirror->url, url) == 0) {
+			return(mirror);
+		}
+	}
+	return(NULL);
+}
+
+/* a server being ranked, see _alam_mirror_rank() */
+struct mirror_rank {
+	char *url;
+	unsigned int failures;
+	double cost;
+};
+
+/* Expected seconds to fetch MIRROR_REFSIZE bytes, 0 if never measured so
+ * that each server gets tried once. A server whose rate is not known yet
+ * is given fallback, or only its latency counts if that is 0 as well. */
+static double mirror_cost(const ammirror_t *mirror, double fallback)
+{
+	double rate;
+
+	if(mirror == NULL) {
+		return(0);
+	}
+	rate = mirror->rate != 0 ? mirror->rate : fallback;
+	if(rate == 0) {
+		return(mirror->latency);
+	}
+	return(mirror->latency + MIRROR_REFSIZE / rate);
+}
+
+static int mirror_cmp(const void *a, const void *b)
+{
+	const struct mirror_rank *ra = a;
+	const struct mirror_rank *rb = b;
+
+	/* mirrors that failed recently go last */
+	if(ra->failures != rb->failures) {
+		return(ra->failures < rb->failures ? -1 : 1);
+	}
+	if(ra->cost != rb->cost) {
+		return(ra->cost < rb->cost ? -1 : 1);
+	}
+	return(0);
+}
+
+/** Order a server list by expected download speed.
+ * Servers that compare equal keep their configured order.
+ * @param servers list of server urls
+ * @return a new list sharing the url strings of servers
+ */
+alam_list_t *_alam_mirror_rank(alam_list_t *servers)
+{
+	alam_list_t *i, *ranks = NULL, *ranked = NULL;
+	struct mirror_rank *rank;
+	double fallback = 0;
+	int measured = 0;
+
+	mirror_load();
+
+	/* servers with no rate yet are assumed as fast as the average one */
+	for(i = handle->mirrors; i; i = i->next) {
+		ammirror_t *mirror = i->data;
+		if(mirror->rate != 0) {
+			fallback += mirror->rate;
+			measured++;
+		}
+	}
+	if(measured) {
+		fallback /= measured;
+	}
+
+	for(i = servers; i; i = i->next) {
+		ammirror_t *mirror = mirror_find(i->data);
+		CALLOC(rank, 1, sizeof(struct mirror_rank), goto error);
+		rank->url = i->data;
+		rank->failures = mirror ? mirror->failures : 0;
+		rank->cost = mirror_cost(mirror, fallback);
+		ranks = alam_list_add(ranks, rank);
+	}
+	ranks = alam_list_msort(ranks, alam_list_count(ranks), mirror_cmp);
+	for(i = ranks; i; i = i->next) {
+		rank = i->data;
+		ranked = alam_list_add(ranked, rank->url);
+	}
+	FREELIST(ranks);
+
+	if(ranked && servers && strcmp(ranked->data, servers->data) != 0) {
+		_alam_log(AM_LOG_DEBUG, "preferring mirror %s\n", (char *)ranked->data);
+	}
+	return(ranked);
+
+error:
+	/* keep the configured order */
+	FREELIST(ranks);
+	return(alam_list_copy(servers));
+}
+
+static void update_avg(double *avg, double sample)
+{
+	if(*avg == 0) {
+		*avg = sample;
+	} else {
+		*avg = (1 - MIRROR_WEIGHT) * *avg + MIRROR_WEIGHT * sample;
+	}
+}
+
+/** Record the outcome of one download from a server.
+ * @param url the server url
+ * @param elapsed seconds the download took
+ * @param size size of the downloaded file
+ * @param ret return value of the download, as for _alam_download_single_file()
+ * @param shared whether other downloads ran at the same time; the time
+ *        then says little about the server and only the outcome is kept
+ */
+void _alam_mirror_record(const char *url, double elapsed, off_t size, int ret,
+		int shared)
+{
+	ammirror_t *mirror;
+
+	pthread_mutex_lock(&mirror_lock);
+	mirror_load();
+	mirror = mirror_find(url);
+	if(mirror == NULL) {
+		CALLOC(mirror, 1, sizeof(ammirror_t), goto cleanup);
+		STRDUP(mirror->url, url, FREE(mirror); goto cleanup);
+		handle->mirrors = alam_list_add(handle->mirrors, mirror);
+	}
+
+	handle->mirrors_changed = 1;
+	if(ret == -1) {
+		mirror->failures++;
+		goto cleanup;
+	}
+	mirror->failures = 0;
+	if(shared) {
+		goto cleanup;
+	}
+	if(ret == 1 || size < MIRROR_SMALLFILE) {
+		update_avg(&mirror->latency, elapsed);
+	} else {
+		double transfer = elapsed - mirror->latency;
+		if(transfer < 0.001) {
+			transfer = 0.001;
+		}
+		update_avg(&mirror->rate, size / transfer);
+	}
+
+cleanup:
+	pthread_mutex_unlock(&mirror_lock);
+}
+
+/** Write the mirror scores to dbpath/mirrors, once the downloads are
+ * done. The file is replaced as a whole, so a concurrent reader never
+ * sees it half written.
+ * @return 0 on success, -1 on error
+ */
+int _alam_mirror_save(void)
+{
+	FILE *fp;
+	char *file, *tmpfile;
+	alam_list_t *i;
+	size_t len;
+	int fd, ret = 0;
+
+	if(!handle->mirrors_changed || handle->dbpath == NULL) {
+		return(0);
+	}
+
+	file = get_mirrorfile();
+	if(file == NULL) {
+		return(-1);
+	}
+	/* file + '.XXXXXX' + NULL */
+	len = strlen(file) + 8;
+	MALLOC(tmpfile, len, FREE(file); RET_ERR(AM_ERR_MEMORY, -1));
+	snprintf(tmpfile, len, "%s.XXXXXX", file);
+	if((fd = mkstemp(tmpfile)) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+		_alam_log(AM_LOG_DEBUG, "could not write mirror scores to %s\n", file);
+		if(fd != -1) {
+			close(fd);
+			unlink(tmpfile);
+		}
+		FREE(tmpfile);
+		FREE(file);
+		return(-1);
+	}
+	fchmod(fd, 0644);
+	/* failures are halved from one run to the next, so that a mirror that
+	 * failed once is not kept last for good */
+	pthread_mutex_lock(&mirror_lock);
+	for(i = handle->mirrors; i; i = i->next) {
+		ammirror_t *mirror = i->data;
+		if(fprintf(fp, "%s %f %f %u\n", mirror->url, mirror->latency,
+					mirror->rate, mirror->failures / 2) <= 0) {
+			ret = -1;
+		}
+	}
+	pthread_mutex_unlock(&mirror_lock);
+	if(fclose(fp) != 0 || ret != 0 || rename(tmpfile, file) != 0) {
+		unlink(tmpfile);
+		ret = -1;
+	} else {
+		handle->mirrors_changed = 0;
+	}
+	FREE(tmpfile);
+	FREE(file);
+	return(ret);
+}
+
+/* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,43 @@
+/*
+ *  mirror.h
+ *
+ *  Copyright (c) 2006-2009 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ALAM_MIRROR_H
+#define _ALAM_MIRROR_H
+
+#include <sys/types.h>
+
+#include "alam_list.h"
+
+/* measured speed of a server, kept in dbpath/mirrors between runs */
+typedef struct _ammirror_t {
+	char *url;
+	double latency;          /* seconds until a small request completes */
+	double rate;             /* bytes per second on large files */
+	unsigned int failures;   /* failures since the last success, halved
+	                           * on each save */
+} ammirror_t;
+
+void _alam_mirror_free(ammirror_t *mirror);
+alam_list_t *_alam_mirror_rank(alam_list_t *servers);
+void _alam_mirror_record(const char *url, double elapsed, off_t size, int ret,
+		int shared);
+int _alam_mirror_save(void);
+
+#endif /* _ALAM_MIRROR_H */
+
+/* vim: set ts=2 sw=2 noet: */
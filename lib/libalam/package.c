@@ -46,6 +46,7 @@
 #include "delta.h"
 #include "handle.h"
 #include "deps.h"
+#include "decompress.h"
 
 /** \addtogroup alam_packages Package Functions
  * @brief Functions to manipulate libalam packages
@@ -70,7 +71,7 @@ int SYMEXPORT alam_pkg_free(ampkg_t *pkg)
 	return(0);
 }
 
-/** Check the integrity (with md5) of a package from the sync cache.
+/** Check the integrity (with sha256 or md5) of a package from the sync cache.
  * @param pkg package pointer
  * @return 0 on success, -1 on error (am_errno is set accordingly)
  */
@@ -88,7 +89,8 @@ int SYMEXPORT alam_pkg_checkmd5sum(ampkg_t *pkg)
 
 	fpath = _alam_filecache_find(alam_pkg_get_filename(pkg));
 
-	retval = _alam_test_md5sum(fpath, alam_pkg_get_md5sum(pkg));
+	retval = _alam_test_checksum(fpath, alam_pkg_get_md5sum(pkg),
+			alam_pkg_get_sha256sum(pkg));
 
 	if(retval == 0) {
 		return(0);
@@ -211,6 +213,20 @@ const char SYMEXPORT *alam_pkg_get_md5sum(ampkg_t *pkg)
 	return pkg->md5sum;
 }
 
+const char SYMEXPORT *alam_pkg_get_sha256sum(ampkg_t *pkg)
+{
+	ALAM_LOG_FUNC;
+
+	/* Sanity checks */
+	ASSERT(handle != NULL, return(NULL));
+	ASSERT(pkg != NULL, return(NULL));
+
+	if(pkg->origin == PKG_FROM_CACHE && !(pkg->infolevel & INFRQ_DESC)) {
+		_alam_db_read(pkg->origin_data.db, pkg, INFRQ_DESC);
+	}
+	return pkg->sha256sum;
+}
+
 const char SYMEXPORT *alam_pkg_get_arch(ampkg_t *pkg)
 {
 	ALAM_LOG_FUNC;
@@ -461,16 +477,8 @@ void SYMEXPORT *alam_pkg_changelog_open(ampkg_t *pkg)
 		const char *pkgfile = pkg->origin_data.file;
 		int ret = ARCHIVE_OK;
 
-		if((archive = archive_read_new()) == NULL) {
-			RET_ERR(AM_ERR_LIBARCHIVE, NULL);
-		}
-
-		archive_read_support_compression_all(archive);
-		archive_read_support_format_all(archive);
-
-		if (archive_read_open_filename(archive, pkgfile,
-					ARCHIVE_DEFAULT_BYTES_PER_BLOCK) != ARCHIVE_OK) {
-			RET_ERR(AM_ERR_PKG_OPEN, NULL);
+		if((archive = _alam_archive_open(pkgfile, NULL)) == NULL) {
+			return(NULL);
 		}
 
 		while((ret = archive_read_next_header(archive, &entry)) == ARCHIVE_OK) {
@@ -598,13 +606,12 @@ alam_list_t SYMEXPORT *alam_pkg_compute_requiredby(ampkg_t *pkg)
  */
 int SYMEXPORT alam_pkg_vercmp(const char *a, const char *b)
 {
-	char oldch1, oldch2;
-	char *str1, *str2;
-	char *ptr1, *ptr2;
-	char *one, *two;
-	int rc;
+	const char *one, *two;
+	const char *ptr1, *ptr2;
+	const char *end1, *end2;
+	size_t len1, len2;
 	int isnum;
-	int ret = 0;
+	int rc;
 
 	ALAM_LOG_FUNC;
 
@@ -618,19 +625,20 @@ int SYMEXPORT alam_pkg_vercmp(const char *a, const char *b)
 	/* easy comparison to see if versions are identical */
 	if(strcmp(a, b) == 0) return(0);
 
-	str1 = strdup(a);
-	str2 = strdup(b);
+	/* the strings are walked in place, a segment is [one, ptr1) and the
+	 * pkgrel is stripped by moving the end of the string */
+	one = a;
+	two = b;
+	end1 = a + strlen(a);
+	end2 = b + strlen(b);
 
-	one = str1;
-	two = str2;
-
-	/* loop through each version segment of str1 and str2 and compare them */
-	while(*one && *two) {
-		while(*one && !isalnum((int)*one)) one++;
-		while(*two && !isalnum((int)*two)) two++;
+	/* loop through each version segment of a and b and compare them */
+	while(one < end1 && two < end2) {
+		while(one < end1 && !isalnum((int)*one)) one++;
+		while(two < end2 && !isalnum((int)*two)) two++;
 
 		/* If we ran to the end of either, we are finished with the loop */
-		if(!(*one && *two)) break;
+		if(!(one < end1 && two < end2)) break;
 
 		ptr1 = one;
 		ptr2 = two;
@@ -639,27 +647,19 @@ int SYMEXPORT alam_pkg_vercmp(const char *a, const char *b)
 		/* leave one and two pointing to the start of the alpha or numeric */
 		/* segment and walk ptr1 and ptr2 to end of segment */
 		if(isdigit((int)*ptr1)) {
-			while(*ptr1 && isdigit((int)*ptr1)) ptr1++;
-			while(*ptr2 && isdigit((int)*ptr2)) ptr2++;
+			while(ptr1 < end1 && isdigit((int)*ptr1)) ptr1++;
+			while(ptr2 < end2 && isdigit((int)*ptr2)) ptr2++;
 			isnum = 1;
 		} else {
-			while(*ptr1 && isalpha((int)*ptr1)) ptr1++;
-			while(*ptr2 && isalpha((int)*ptr2)) ptr2++;
+			while(ptr1 < end1 && isalpha((int)*ptr1)) ptr1++;
+			while(ptr2 < end2 && isalpha((int)*ptr2)) ptr2++;
 			isnum = 0;
 		}
 
-		/* save character at the end of the alpha or numeric segment */
-		/* so that they can be restored after the comparison */
-		oldch1 = *ptr1;
-		*ptr1 = '\0';
-		oldch2 = *ptr2;
-		*ptr2 = '\0';
-
 		/* this cannot happen, as we previously tested to make sure that */
 		/* the first string has a non-null segment */
 		if (one == ptr1) {
-			ret = -1;	/* arbitrary */
-			goto cleanup;
+			return(-1);	/* arbitrary */
 		}
 
 		/* take care of the case where the two version segments are */
@@ -667,8 +667,7 @@ int SYMEXPORT alam_pkg_vercmp(const char *a, const char *b)
 		/* numeric segments are always newer than alpha segments */
 		/* XXX See patch #60884 (and details) from bugzilla #50977. */
 		if (two == ptr2) {
-			ret = isnum ? 1 : -1;
-			goto cleanup;
+			return(isnum ? 1 : -1);
 		}
 
 		if (isnum) {
@@ -681,30 +680,29 @@ int SYMEXPORT alam_pkg_vercmp(const char *a, const char *b)
 			while (*two == '0') two++;
 
 			/* whichever number has more digits wins */
-			if (strlen(one) > strlen(two)) {
-				ret = 1;
-				goto cleanup;
+			if (ptr1 - one > ptr2 - two) {
+				return(1);
 			}
-			if (strlen(two) > strlen(one)) {
-				ret = -1;
-				goto cleanup;
+			if (ptr2 - two > ptr1 - one) {
+				return(-1);
 			}
 		}
 
-		/* strcmp will return which one is greater - even if the two */
+		/* compare the segments like strcmp would - even if the two */
 		/* segments are alpha or if they are numeric.  don't return  */
 		/* if they are equal because there might be more segments to */
 		/* compare */
-		rc = strcmp(one, two);
+		len1 = ptr1 - one;
+		len2 = ptr2 - two;
+		rc = memcmp(one, two, len1 < len2 ? len1 : len2);
 		if (rc) {
-			ret = rc < 1 ? -1 : 1;
-			goto cleanup;
+			return(rc < 0 ? -1 : 1);
+		}
+		if (len1 != len2) {
+			return(len1 < len2 ? -1 : 1);
 		}
 
-		/* restore character that was replaced by null above */
-		*ptr1 = oldch1;
 		one = ptr1;
-		*ptr2 = oldch2;
 		two = ptr2;
 
 		/* libalam added code. check if version strings have hit the pkgrel
@@ -716,20 +714,19 @@ int SYMEXPORT alam_pkg_vercmp(const char *a, const char *b)
 		} else if(*ptr1 == '-') {
 			/* ptr1 has hit the pkgrel and ptr2 has not. continue version
 			 * comparison after stripping the pkgrel from ptr1. */
-			*ptr1 = '\0';
+			end1 = ptr1;
 		} else if(*ptr2 == '-') {
 			/* ptr2 has hit the pkgrel and ptr1 has not. continue version
 			 * comparison after stripping the pkgrel from ptr2. */
-			*ptr2 = '\0';
+			end2 = ptr2;
 		}
 	}
 
 	/* this catches the case where all numeric and alpha segments have */
 	/* compared identically but the segment separating characters were */
 	/* different */
-	if ((!*one) && (!*two)) {
-		ret = 0;
-		goto cleanup;
+	if (one == end1 && two == end2) {
+		return(0);
 	}
 
 	/* the final showdown. we never want a remaining alpha string to
@@ -738,17 +735,11 @@ int SYMEXPORT alam_pkg_vercmp(const char *a, const char *b)
 	 * - if one is an alpha, two is newer.
 	 * - otherwise one is newer.
 	 * */
-	if ( ( !*one && !isalpha((int)*two) )
-			|| isalpha((int)*one) ) {
-		ret = -1;
-	} else {
-		ret = 1;
+	if ( ( one == end1 && !isalpha((int)*two) )
+			|| ( one < end1 && isalpha((int)*one) ) ) {
+		return(-1);
 	}
-
-cleanup:
-	free(str1);
-	free(str2);
-	return(ret);
+	return(1);
 }
 
 /** @} */
@@ -782,6 +773,7 @@ ampkg_t *_alam_pkg_dup(ampkg_t *pkg)
 	newpkg->installdate = pkg->installdate;
 	STRDUP(newpkg->packager, pkg->packager, RET_ERR(AM_ERR_MEMORY, newpkg));
 	STRDUP(newpkg->md5sum, pkg->md5sum, RET_ERR(AM_ERR_MEMORY, newpkg));
+	STRDUP(newpkg->sha256sum, pkg->sha256sum, RET_ERR(AM_ERR_MEMORY, newpkg));
 	STRDUP(newpkg->arch, pkg->arch, RET_ERR(AM_ERR_MEMORY, newpkg));
 	newpkg->size = pkg->size;
 	newpkg->isize = pkg->isize;
@@ -822,32 +814,48 @@ void _alam_pkg_free(ampkg_t *pkg)
 		return;
 	}
 
-	FREE(pkg->filename);
-	FREE(pkg->name);
-	FREE(pkg->version);
-	FREE(pkg->desc);
-	FREE(pkg->url);
-	FREE(pkg->packager);
-	FREE(pkg->md5sum);
-	FREE(pkg->arch);
-	FREELIST(pkg->licenses);
-	FREELIST(pkg->replaces);
-	FREELIST(pkg->groups);
-	FREELIST(pkg->files);
-	FREELIST(pkg->backup);
-	alam_list_free_inner(pkg->depends, (alam_list_fn_free)_alam_dep_free);
-	alam_list_free(pkg->depends);
-	FREELIST(pkg->optdepends);
-	FREELIST(pkg->conflicts);
-	FREELIST(pkg->provides);
+	if(pkg->arena) {
+		/* the strings and dependencies go with the db's arena */
+		alam_list_free(pkg->licenses);
+		alam_list_free(pkg->replaces);
+		alam_list_free(pkg->groups);
+		alam_list_free(pkg->files);
+		alam_list_free(pkg->backup);
+		alam_list_free(pkg->depends);
+		alam_list_free(pkg->optdepends);
+		alam_list_free(pkg->conflicts);
+		alam_list_free(pkg->provides);
+	} else {
+		FREE(pkg->filename);
+		FREE(pkg->name);
+		FREE(pkg->version);
+		FREE(pkg->desc);
+		FREE(pkg->url);
+		FREE(pkg->packager);
+		FREE(pkg->md5sum);
+		FREE(pkg->sha256sum);
+		FREE(pkg->arch);
+		FREELIST(pkg->licenses);
+		FREELIST(pkg->replaces);
+		FREELIST(pkg->groups);
+		FREELIST(pkg->files);
+		FREELIST(pkg->backup);
+		alam_list_free_inner(pkg->depends, (alam_list_fn_free)_alam_dep_free);
+		alam_list_free(pkg->depends);
+		FREELIST(pkg->optdepends);
+		FREELIST(pkg->conflicts);
+		FREELIST(pkg->provides);
+	}
 	alam_list_free_inner(pkg->deltas, (alam_list_fn_free)_alam_delta_free);
 	alam_list_free(pkg->deltas);
 	alam_list_free(pkg->delta_path);
 	alam_list_free(pkg->removes);
+	FREE(pkg->verkey);
 
 	if(pkg->origin == PKG_FROM_FILE) {
 		FREE(pkg->origin_data.file);
 	}
+	FREE(pkg->spool);
 	FREE(pkg);
 }
 
@@ -873,15 +881,160 @@ void _alam_pkg_free_trans(ampkg_t *pkg)
 	pkg->removes = NULL;
 }
 
+/** Split a version into the segments alam_pkg_vercmp() walks.
+ * @param version the version, which must outlive the key
+ * @return the key, or NULL on error
+ */
+amverkey_t *_alam_verkey_new(const char *version)
+{
+	amverkey_t *key;
+	const char *p;
+	size_t count = 0;
+	int inseg = 0;
+
+	for(p = version; *p; p++) {
+		/* a segment starts at each switch to a digit or an alpha run */
+		if(isdigit((int)*p)) {
+			count += (inseg != 1);
+			inseg = 1;
+		} else if(isalpha((int)*p)) {
+			count += (inseg != 2);
+			inseg = 2;
+		} else {
+			inseg = 0;
+		}
+	}
+
+	MALLOC(key, sizeof(amverkey_t) + count * sizeof(struct verseg),
+			RET_ERR(AM_ERR_MEMORY, NULL));
+	key->count = 0;
+	key->tail = 0;
+
+	p = version;
+	while(*p) {
+		struct verseg *seg = &key->segs[key->count];
+		const char *start = p;
+
+		while(*p && !isalnum((int)*p)) p++;
+		if(!*p) {
+			key->tail = (p != start);
+			break;
+		}
+		seg->sep = (p != start);
+		seg->isnum = (isdigit((int)*p) != 0);
+		start = p;
+		if(seg->isnum) {
+			while(*p && isdigit((int)*p)) p++;
+			while(*start == '0') start++;
+		} else {
+			while(*p && isalpha((int)*p)) p++;
+		}
+		seg->str = start;
+		seg->len = p - start;
+		seg->dash = (*p == '-');
+		key->count++;
+	}
+	return(key);
+}
+
+/* what the final check of alam_pkg_vercmp() sees left of a version */
+enum { VERKEY_END, VERKEY_ALPHA, VERKEY_OTHER };
+
+static int verkey_rest(const amverkey_t *key, size_t i, int ended, int skipped)
+{
+	if(ended) {
+		return(VERKEY_END);
+	}
+	if(i == key->count) {
+		return(key->tail && !skipped ? VERKEY_OTHER : VERKEY_END);
+	}
+	if(key->segs[i].sep && !skipped) {
+		return(VERKEY_OTHER);
+	}
+	return(key->segs[i].isnum ? VERKEY_OTHER : VERKEY_ALPHA);
+}
+
+/** Compare two version keys, with the same result as alam_pkg_vercmp() on
+ * the versions they were built from. */
+int _alam_verkey_cmp(const amverkey_t *a, const amverkey_t *b)
+{
+	size_t i = 0;
+	int ended1 = 0, ended2 = 0;
+	int skipped = 0;
+	int rest1, rest2;
+
+	while(!ended1 && !ended2 && (i < a->count || a->tail)
+			&& (i < b->count || b->tail)) {
+		const struct verseg *seg1, *seg2;
+		size_t len;
+		int rc;
+
+		/* the separators before the segments are skipped */
+		skipped = 1;
+		if(i == a->count || i == b->count) {
+			break;
+		}
+		seg1 = &a->segs[i];
+		seg2 = &b->segs[i];
+		if(seg1->isnum != seg2->isnum) {
+			return(seg1->isnum ? 1 : -1);
+		}
+		if(seg1->isnum && seg1->len != seg2->len) {
+			return(seg1->len > seg2->len ? 1 : -1);
+		}
+		len = seg1->len < seg2->len ? seg1->len : seg2->len;
+		if((rc = memcmp(seg1->str, seg2->str, len)) != 0) {
+			return(rc < 0 ? -1 : 1);
+		}
+		if(seg1->len != seg2->len) {
+			return(seg1->len < seg2->len ? -1 : 1);
+		}
+		skipped = 0;
+
+		/* a pkgrel is only compared if both versions have one */
+		if(seg1->dash != seg2->dash) {
+			ended1 = seg1->dash;
+			ended2 = seg2->dash;
+		}
+		i++;
+	}
+
+	rest1 = verkey_rest(a, i, ended1, skipped);
+	rest2 = verkey_rest(b, i, ended2, skipped);
+	if(rest1 == VERKEY_END && rest2 == VERKEY_END) {
+		return(0);
+	}
+	if((rest1 == VERKEY_END && rest2 != VERKEY_ALPHA) || rest1 == VERKEY_ALPHA) {
+		return(-1);
+	}
+	return(1);
+}
+
+/* The version key of a package, built the first time it is needed. */
+static amverkey_t *pkg_verkey(ampkg_t *pkg)
+{
+	if(pkg->verkey == NULL && alam_pkg_get_version(pkg) != NULL) {
+		pkg->verkey = _alam_verkey_new(pkg->version);
+	}
+	return(pkg->verkey);
+}
+
 /* Is spkg an upgrade for locapkg? */
 int _alam_pkg_compare_versions(ampkg_t *spkg, ampkg_t *localpkg)
 {
+	amverkey_t *skey, *localkey;
 	int cmp = 0;
 
 	ALAM_LOG_FUNC;
 
-	cmp = alam_pkg_vercmp(alam_pkg_get_version(spkg),
-			alam_pkg_get_version(localpkg));
+	skey = pkg_verkey(spkg);
+	localkey = pkg_verkey(localpkg);
+	if(skey && localkey) {
+		cmp = _alam_verkey_cmp(skey, localkey);
+	} else {
+		cmp = alam_pkg_vercmp(alam_pkg_get_version(spkg),
+				alam_pkg_get_version(localpkg));
+	}
 
 	if(cmp < 0 && alam_pkg_has_force(spkg)) {
 		cmp = 1;
@@ -25,6 +25,24 @@
 #include "alam.h"
 #include "db.h"
 
+/* A segment of a version, see amverkey_t */
+struct verseg {
+	const char *str; /* numbers start after their leading zeros */
+	size_t len;
+	unsigned char isnum;
+	unsigned char sep; /* preceded by non alphanumeric characters */
+	unsigned char dash; /* followed by a '-' */
+};
+
+/* A version split into its alpha and numeric segments once, so comparing
+ * it again and again only compares lengths and bytes. The segments point
+ * into the version string. */
+typedef struct _amverkey_t {
+	size_t count;
+	unsigned char tail; /* non alphanumeric characters after the last segment */
+	struct verseg segs[];
+} amverkey_t;
+
 typedef enum _ampkgfrom_t {
 	PKG_FROM_CACHE = 1,
 	PKG_FROM_FILE
@@ -40,6 +58,7 @@ struct __ampkg_t {
 	time_t installdate;
 	char *packager;
 	char *md5sum;
+	char *sha256sum;
 	char *arch;
 	off_t size;
 	off_t isize;
@@ -70,6 +89,9 @@ struct __ampkg_t {
 		char *file;
 	} origin_data;
 	amdbinfrq_t infolevel;
+	char *spool; /* uncompressed copy of the package file, or NULL */
+	amarena_t *arena; /* db arena the strings come from, NULL if malloc'd */
+	amverkey_t *verkey; /* built from version on first comparison */
 };
 
 ampkg_t* _alam_pkg_new(void);
@@ -77,10 +99,16 @@ ampkg_t *_alam_pkg_dup(ampkg_t *pkg);
 void _alam_pkg_free(ampkg_t *pkg);
 void _alam_pkg_free_trans(ampkg_t *pkg);
 int _alam_pkg_cmp(const void *p1, const void *p2);
+amverkey_t *_alam_verkey_new(const char *version);
+int _alam_verkey_cmp(const amverkey_t *a, const amverkey_t *b);
 int _alam_pkg_compare_versions(ampkg_t *local_pkg, ampkg_t *pkg);
 ampkg_t *_alam_pkg_find(alam_list_t *haystack, const char *needle);
 int _alam_pkg_should_ignore(ampkg_t *pkg);
 
+/* be_package.c */
+int _alam_pkg_load_spooled(const char *filename, const char *spooldir,
+		off_t *spoolroom, ampkg_t **pkg);
+
 #endif /* _ALAM_PACKAGE_H */
 
 /* vim: set ts=2 sw=2 noet: */
@@ -0,0 +1,227 @@
+/*
+ *  repoindex.c
+ *
+ *  Copyright (c) 2006-2009 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* libalam */
+#include "repoindex.h"
+#include "alam_list.h"
+#include "util.h"
+#include "log.h"
+#include "package.h"
+#include "cache.h"
+#include "db.h"
+#include "handle.h"
+#include "alam.h"
+
+/* The sync dbs are searched in the order they were registered, and the
+ * first one having a package wins. Instead of looking a name up in each
+ * db in turn, the handle keeps two indexes over all of them: one by
+ * package name and one by provision. Loading, changing or freeing the
+ * package cache of a sync db only marks the indexes out of date; they
+ * are built again, once, the next time they are used. */
+
+static int entry_cmp(const void *p1, const void *p2)
+{
+	const amrepoentry_t *e1 = p1;
+	const amrepoentry_t *e2 = p2;
+	size_t len = e1->namelen < e2->namelen ? e1->namelen : e2->namelen;
+	int cmp = memcmp(e1->name, e2->name, len);
+
+	if(cmp == 0 && e1->namelen != e2->namelen) {
+		cmp = e1->namelen < e2->namelen ? -1 : 1;
+	}
+	if(cmp == 0 && e1->rank != e2->rank) {
+		cmp = e1->rank < e2->rank ? -1 : 1;
+	}
+	if(cmp == 0) {
+		cmp = strcmp(e1->pkg->name, e2->pkg->name);
+	}
+	return(cmp);
+}
+
+/* Build index over the packages of the loaded sync db caches.
+ * @return 0 on success, -1 on error (am_errno is set accordingly)
+ */
+static int index_build(amrepoindex_t *index, int provides)
+{
+	amrepoentry_t *entries = NULL;
+	alam_list_t *i;
+	size_t count = 0, n, k;
+
+	for(i = handle->dbs_sync; i; i = i->next) {
+		amdb_t *db = i->data;
+		if(!db->pkgcache_loaded) {
+			continue;
+		}
+		for(n = 0; n < db->pkgcount; n++) {
+			count += provides ?
+				alam_list_count(alam_pkg_get_provides(db->pkgvec[n])) : 1;
+		}
+	}
+	if(count) {
+		MALLOC(entries, count * sizeof(amrepoentry_t),
+				RET_ERR(AM_ERR_MEMORY, -1));
+	}
+
+	count = 0;
+	for(i = handle->dbs_sync; i; i = i->next) {
+		amdb_t *db = i->data;
+		if(!db->pkgcache_loaded) {
+			continue;
+		}
+		for(n = 0; n < db->pkgcount; n++) {
+			ampkg_t *pkg = db->pkgvec[n];
+			alam_list_t *p;
+
+			if(!provides) {
+				entries[count].name = pkg->name;
+				entries[count].namelen = strlen(pkg->name);
+				entries[count].pkg = pkg;
+				entries[count].rank = db->rank;
+				count++;
+				continue;
+			}
+			for(p = alam_pkg_get_provides(pkg); p; p = p->next) {
+				const char *prov = p->data;
+				const char *ver = strchr(prov, '=');
+
+				entries[count].name = prov;
+				entries[count].namelen = ver ? (size_t)(ver - prov) : strlen(prov);
+				entries[count].pkg = pkg;
+				entries[count].rank = db->rank;
+				count++;
+			}
+		}
+	}
+	if(count) {
+		qsort(entries, count, sizeof(amrepoentry_t), entry_cmp);
+	}
+
+	/* a package providing the same name twice is listed once */
+	for(n = 0, k = 0; n < count; n++) {
+		if(k && entries[k - 1].pkg == entries[n].pkg
+				&& entry_cmp(&entries[k - 1], &entries[n]) == 0) {
+			continue;
+		}
+		entries[k++] = entries[n];
+	}
+
+	FREE(index->entries);
+	index->entries = entries;
+	index->count = k;
+	index->provides = provides;
+	index->loaded = 1;
+	return(0);
+}
+
+/** Mark the indexes out of date. Called whenever the package cache of a
+ * sync db is loaded, changed or freed.
+ */
+void _alam_repoindex_invalidate(amdb_t *db)
+{
+	if(handle == NULL || db == NULL || db->rank == 0) {
+		return;
+	}
+	handle->pkgindex.loaded = 0;
+	handle->provindex.loaded = 0;
+}
+
+/** Get the indexes ready for _alam_repoindex_find(), loading the package
+ * caches of the sync dbs first. Dbs whose cache fails to load are left
+ * out, and not tried again until they are updated.
+ * @return 0 on success, -1 if the indexes could not be built (am_errno is
+ * set accordingly); callers then search the dbs one by one
+ */
+int _alam_repoindex_load(void)
+{
+	alam_list_t *i;
+
+	ALAM_LOG_FUNC;
+
+	ASSERT(handle != NULL, RET_ERR(AM_ERR_HANDLE_NULL, -1));
+
+	for(i = handle->dbs_sync; i; i = i->next) {
+		amdb_t *db = i->data;
+		if(!db->pkgcache_loaded && !db->pkgcache_failed) {
+			_alam_db_load_pkgcache(db);
+		}
+	}
+
+	if(!handle->pkgindex.loaded && index_build(&handle->pkgindex, 0) != 0) {
+		return(-1);
+	}
+	if(!handle->provindex.loaded && index_build(&handle->provindex, 1) != 0) {
+		return(-1);
+	}
+	return(0);
+}
+
+/** Find the packages of the sync dbs named name, or providing name.
+ * The indexes must have been readied by _alam_repoindex_load().
+ * @param name the name to look up
+ * @param provides look up provisions instead of package names
+ * @param count where to store the number of packages found
+ * @return the packages found in sync db order, NULL if none
+ */
+amrepoentry_t *_alam_repoindex_find(const char *name, int provides,
+		size_t *count)
+{
+	amrepoindex_t *index;
+	size_t len, lo = 0, hi, first;
+
+	ALAM_LOG_FUNC;
+
+	*count = 0;
+	if(handle == NULL || name == NULL) {
+		return(NULL);
+	}
+	index = provides ? &handle->provindex : &handle->pkgindex;
+	if(!index->loaded) {
+		return(NULL);
+	}
+
+	/* lower bound of name, its entry in the first db */
+	len = strlen(name);
+	hi = index->count;
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const amrepoentry_t *entry = &index->entries[mid];
+		int cmp = memcmp(entry->name, name,
+				entry->namelen < len ? entry->namelen : len);
+		if(cmp < 0 || (cmp == 0 && entry->namelen < len)) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	first = lo;
+	while(lo < index->count && index->entries[lo].namelen == len
+			&& memcmp(index->entries[lo].name, name, len) == 0) {
+		lo++;
+	}
+
+	*count = lo - first;
+	return(*count ? &index->entries[first] : NULL);
+}
+
+/* vim: set ts=2 sw=2 noet: */
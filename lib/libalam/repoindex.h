@@ -0,0 +1,50 @@
+/*
+ *  repoindex.h
+ *
+ *  Copyright (c) 2006-2009 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _ALAM_REPOINDEX_H
+#define _ALAM_REPOINDEX_H
+
+#include <sys/types.h>
+
+#include "alam.h"
+
+/* a package of a sync db, found under name */
+typedef struct _amrepoentry_t {
+	const char *name; /* not terminated for provisions with a version */
+	size_t namelen;
+	ampkg_t *pkg;
+	unsigned int rank; /* rank of the db in the sync db order */
+} amrepoentry_t;
+
+/* All the packages of the sync dbs by name, or by provision, sorted by
+ * name, then by db order, then by package name. */
+typedef struct _amrepoindex_t {
+	amrepoentry_t *entries;
+	size_t count;
+	unsigned short loaded;
+	unsigned short provides; /* indexed by provisions instead of names */
+} amrepoindex_t;
+
+void _alam_repoindex_invalidate(amdb_t *db);
+int _alam_repoindex_load(void);
+amrepoentry_t *_alam_repoindex_find(const char *name, int provides,
+		size_t *count);
+
+#endif /* _ALAM_REPOINDEX_H */
+
+/* vim: set ts=2 sw=2 noet: */
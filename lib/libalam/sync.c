@@ -32,6 +32,9 @@
 #include <unistd.h>
 #include <time.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 
 /* libalam */
 #include "sync.h"
@@ -49,6 +52,8 @@
 #include "alam.h"
 #include "dload.h"
 #include "delta.h"
+#include "checksum.h"
+#include "mirror.h"
 #include "remove.h"
 
 /** Check for new version of pkg in sync repos
@@ -61,8 +66,16 @@ ampkg_t SYMEXPORT *alam_sync_newversion(ampkg_t *pkg, alam_list_t *dbs_sync)
 	alam_list_t *i;
 	ampkg_t *spkg = NULL;
 
-	for(i = dbs_sync; !spkg && i; i = i->next) {
-		spkg = _alam_db_get_pkgfromcache(i->data, alam_pkg_get_name(pkg));
+	if(handle && dbs_sync && dbs_sync == handle->dbs_sync
+			&& _alam_repoindex_load() == 0) {
+		/* the first db having it wins */
+		size_t count;
+		amrepoentry_t *entries = _alam_repoindex_find(alam_pkg_get_name(pkg), 0, &count);
+		spkg = entries ? entries[0].pkg : NULL;
+	} else {
+		for(i = dbs_sync; !spkg && i; i = i->next) {
+			spkg = _alam_db_get_pkgfromcache(i->data, alam_pkg_get_name(pkg));
+		}
 	}
 
 	if(spkg == NULL) {
@@ -82,29 +95,92 @@ ampkg_t SYMEXPORT *alam_sync_newversion(ampkg_t *pkg, alam_list_t *dbs_sync)
 	return(NULL);
 }
 
+/* Look up name in targets, a sorted array of package names. */
+static int sorted_find(const char **targets, size_t count, const char *name)
+{
+	size_t lo = 0, hi = count;
+
+	while(lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(targets[mid], name);
+		if(cmp == 0) {
+			return(1);
+		} else if(cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return(0);
+}
+
+static int str_cmp(const void *s1, const void *s2)
+{
+	return(strcmp(*(const char * const *)s1, *(const char * const *)s2));
+}
+
 int _alam_sync_sysupgrade(amtrans_t *trans, amdb_t *db_local, alam_list_t *dbs_sync, int enable_downgrade)
 {
-	alam_list_t *i, *j, *k;
+	alam_list_t *i, *j;
+	alam_list_t *replacers = NULL;
+	const char **targets = NULL;
+	size_t *cursors = NULL;
+	size_t ntargets, ndbs, d;
 
 	ALAM_LOG_FUNC;
 
 	_alam_log(AM_LOG_DEBUG, "checking for package upgrades\n");
+
+	/* The local and sync caches are all sorted by name, so the literal
+	 * upgrades are found by walking them side by side, with one cursor per
+	 * sync db. Targets already in the list are looked up in a sorted copy
+	 * of their names, and the replacers in the replaces index of each db. */
+	ntargets = alam_list_count(trans->add);
+	ndbs = alam_list_count(dbs_sync);
+	if(ntargets) {
+		MALLOC(targets, ntargets * sizeof(char *), RET_ERR(AM_ERR_MEMORY, -1));
+		for(i = trans->add, d = 0; i; i = i->next, d++) {
+			targets[d] = alam_pkg_get_name(i->data);
+		}
+		qsort(targets, ntargets, sizeof(char *), str_cmp);
+	}
+	if(ndbs) {
+		CALLOC(cursors, ndbs, sizeof(size_t), FREE(targets); RET_ERR(AM_ERR_MEMORY, -1));
+	}
+	for(j = dbs_sync; j; j = j->next) {
+		_alam_db_get_pkgcache(j->data);
+	}
+
 	for(i = _alam_db_get_pkgcache(db_local); i; i = i->next) {
 		ampkg_t *lpkg = i->data;
 
-		if(_alam_pkg_find(trans->add, lpkg->name)) {
+		if(sorted_find(targets, ntargets, lpkg->name)
+				|| _alam_pkg_find(replacers, lpkg->name)) {
 			_alam_log(AM_LOG_DEBUG, "%s is already in the target list -- skipping\n", lpkg->name);
 			continue;
 		}
 
 		/* Search for literal then replacers in each sync database.
 		 * If found, don't check other databases */
-		for(j = dbs_sync; j; j = j->next) {
+		for(j = dbs_sync, d = 0; j; j = j->next, d++) {
 			amdb_t *sdb = j->data;
+			ampkg_t *spkg = NULL;
+			amreplacer_t *repl;
+			size_t nrepl, r;
+			int found = 0;
+			int cmp;
+
 			/* Check sdb */
-			ampkg_t *spkg = _alam_db_get_pkgfromcache(sdb, lpkg->name);
+			while(cursors[d] < sdb->pkgcount
+					&& (cmp = strcmp(sdb->pkgvec[cursors[d]]->name, lpkg->name)) <= 0) {
+				if(cmp == 0) {
+					spkg = sdb->pkgvec[cursors[d]];
+					break;
+				}
+				cursors[d]++;
+			}
 			if(spkg) { /* 1. literal was found in sdb */
-				int cmp = _alam_pkg_compare_versions(spkg, lpkg);
+				cmp = _alam_pkg_compare_versions(spkg, lpkg);
 				if(cmp > 0) {
 					_alam_log(AM_LOG_DEBUG, "new version of '%s' found (%s => %s)\n",
 								lpkg->name, lpkg->version, spkg->version);
@@ -134,58 +210,61 @@ int _alam_sync_sysupgrade(amtrans_t *trans, amdb_t *db_local, alam_list_t *dbs_s
 					}
 				}
 				break; /* jump to next local package */
-			} else { /* 2. search for replacers in sdb */
-				int found = 0;
-				for(k = _alam_db_get_pkgcache(sdb); k; k = k->next) {
-					spkg = k->data;
-					if(alam_list_find_str(alam_pkg_get_replaces(spkg), lpkg->name)) {
-						found = 1;
-						/* check IgnorePkg/IgnoreGroup */
-						if(_alam_pkg_should_ignore(spkg) || _alam_pkg_should_ignore(lpkg)) {
-							_alam_log(AM_LOG_WARNING, _("ignoring package replacement (%s-%s => %s-%s)\n"),
-										lpkg->name, lpkg->version, spkg->name, spkg->version);
-							continue;
-						}
+			}
 
-						int doreplace = 0;
-						QUESTION(trans, AM_TRANS_CONV_REPLACE_PKG, lpkg, spkg, sdb->treename, &doreplace);
-						if(!doreplace) {
-							continue;
-						}
+			/* 2. search for replacers in sdb */
+			repl = _alam_db_get_replacers(sdb, lpkg->name, &nrepl);
+			for(r = 0; r < nrepl; r++) {
+				spkg = repl[r].pkg;
+				found = 1;
+				/* check IgnorePkg/IgnoreGroup */
+				if(_alam_pkg_should_ignore(spkg) || _alam_pkg_should_ignore(lpkg)) {
+					_alam_log(AM_LOG_WARNING, _("ignoring package replacement (%s-%s => %s-%s)\n"),
+								lpkg->name, lpkg->version, spkg->name, spkg->version);
+					continue;
+				}
 
-						/* If spkg is already in the target list, we append lpkg to spkg's removes list */
-						ampkg_t *tpkg = _alam_pkg_find(trans->add, spkg->name);
-						if(tpkg) {
-							/* sanity check, multiple repos can contain spkg->name */
-							if(tpkg->origin_data.db != sdb) {
-								_alam_log(AM_LOG_WARNING, _("cannot replace %s by %s\n"),
-													lpkg->name, spkg->name);
-								continue;
-							}
-							_alam_log(AM_LOG_DEBUG, "appending %s to the removes list of %s\n",
-												lpkg->name, tpkg->name);
-							tpkg->removes = alam_list_add(tpkg->removes, lpkg);
-							/* check the to-be-replaced package's reason field */
-							if(alam_pkg_get_reason(lpkg) == AM_PKG_REASON_EXPLICIT) {
-								tpkg->reason = AM_PKG_REASON_EXPLICIT;
-							}
-						} else { /* add spkg to the target list */
-							/* copy over reason */
-							spkg->reason = alam_pkg_get_reason(lpkg);
-							spkg->removes = alam_list_add(NULL, lpkg);
-							_alam_log(AM_LOG_DEBUG, "adding package %s-%s to the transaction targets\n",
-													spkg->name, spkg->version);
-							trans->add = alam_list_add(trans->add, spkg);
-						}
-					}
+				int doreplace = 0;
+				QUESTION(trans, AM_TRANS_CONV_REPLACE_PKG, lpkg, spkg, sdb->treename, &doreplace);
+				if(!doreplace) {
+					continue;
 				}
-				if(found) {
-					break; /* jump to next local package */
+
+				/* If spkg is already in the target list, we append lpkg to spkg's removes list */
+				ampkg_t *tpkg = _alam_pkg_find(trans->add, spkg->name);
+				if(tpkg) {
+					/* sanity check, multiple repos can contain spkg->name */
+					if(tpkg->origin_data.db != sdb) {
+						_alam_log(AM_LOG_WARNING, _("cannot replace %s by %s\n"),
+											lpkg->name, spkg->name);
+						continue;
+					}
+					_alam_log(AM_LOG_DEBUG, "appending %s to the removes list of %s\n",
+										lpkg->name, tpkg->name);
+					tpkg->removes = alam_list_add(tpkg->removes, lpkg);
+					/* check the to-be-replaced package's reason field */
+					if(alam_pkg_get_reason(lpkg) == AM_PKG_REASON_EXPLICIT) {
+						tpkg->reason = AM_PKG_REASON_EXPLICIT;
+					}
+				} else { /* add spkg to the target list */
+					/* copy over reason */
+					spkg->reason = alam_pkg_get_reason(lpkg);
+					spkg->removes = alam_list_add(NULL, lpkg);
+					_alam_log(AM_LOG_DEBUG, "adding package %s-%s to the transaction targets\n",
+											spkg->name, spkg->version);
+					trans->add = alam_list_add(trans->add, spkg);
+					replacers = alam_list_add(replacers, spkg);
 				}
 			}
+			if(found) {
+				break; /* jump to next local package */
+			}
 		}
 	}
 
+	alam_list_free(replacers);
+	FREE(cursors);
+	FREE(targets);
 	return(0);
 }
 
@@ -274,6 +353,34 @@ int _alam_sync_addtarget(amtrans_t *trans, amdb_t *db_local, alam_list_t *dbs_sy
 	return(0);
 }
 
+/* Tests the cached deltas of a delta path that were not checked yet.
+ * Returns nonzero if one of them is corrupted, it is then left out of the
+ * next path search. */
+static int check_cached_deltas(alam_list_t *path)
+{
+	alam_list_t *i;
+	int bad = 0;
+
+	for(i = path; i; i = i->next) {
+		amdelta_t *d = i->data;
+		char *filepath;
+
+		if(d->download_size != 0 || d->verified != 0) {
+			continue;
+		}
+		filepath = _alam_filecache_find(d->delta);
+		if(_alam_test_checksum(filepath, d->delta_md5, NULL) == 0) {
+			d->verified = 1;
+		} else {
+			_alam_log(AM_LOG_DEBUG, "cached delta %s is corrupted\n", d->delta);
+			d->verified = -1;
+			bad = 1;
+		}
+		FREE(filepath);
+	}
+	return(bad);
+}
+
 /** Compute the size of the files that will be downloaded to install a
  * package.
  * @param newpkg the new package to upgrade to
@@ -300,10 +407,17 @@ static int compute_download_size(ampkg_t *newpkg)
 		off_t dltsize;
 		off_t pkgsize = alam_pkg_get_size(newpkg);
 
-		dltsize = _alam_shortest_delta_path(
-			alam_pkg_get_deltas(newpkg),
-			alam_pkg_get_filename(newpkg),
-			&newpkg->delta_path);
+		/* the cached deltas of the path are checked now, and the search
+		 * goes again without the corrupted ones */
+		do {
+			alam_list_free(newpkg->delta_path);
+			newpkg->delta_path = NULL;
+			dltsize = _alam_shortest_delta_path(
+				alam_pkg_get_deltas(newpkg),
+				alam_pkg_get_filename(newpkg),
+				&newpkg->delta_path);
+		} while(newpkg->delta_path && dltsize < pkgsize * MAX_DELTA_RATIO
+				&& check_cached_deltas(newpkg->delta_path) != 0);
 
 		if(newpkg->delta_path && (dltsize < pkgsize * MAX_DELTA_RATIO)) {
 			_alam_log(AM_LOG_DEBUG, "using delta size\n");
@@ -571,6 +685,10 @@ int _alam_sync_prepare(amtrans_t *trans, amdb_t *db_local, alam_list_t *dbs_sync
 	}
 
 cleanup:
+	if(handle->usedelta) {
+		/* the deltas checked here are not hashed again by the commit */
+		_alam_checksum_save();
+	}
 	alam_list_free(unresolvable);
 
 	return(ret);
@@ -586,10 +704,108 @@ off_t SYMEXPORT alam_pkg_download_size(ampkg_t *newpkg)
 	return(newpkg->download_size);
 }
 
-static int endswith(const char *filename, const char *extension)
+/* the delta chain of one package, applied by a patch_worker() */
+struct patch_job {
+	alam_list_t *delta_path;
+	int applied;            /* deltas of the chain applied so far */
+	int failed;             /* the delta after those failed */
+};
+
+struct patch_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t progress;  /* signalled when a delta is done */
+	const char *cachedir;
+	struct patch_job *jobs;
+	int count;
+	int next;
+};
+
+/** Applies one delta of a package's delta chain.
+ *
+ * The delta file and the package it started from are deleted afterwards,
+ * unless that package is the first of the chain.
+ *
+ * @param delta_path the delta chain
+ * @param dlts the element of the chain to apply
+ * @param cachedir the cachedir the packages are created in
+ *
+ * @return 0 on success, -1 on error
+ */
+static int apply_delta(alam_list_t *delta_path, alam_list_t *dlts,
+		const char *cachedir)
+{
+	amdelta_t *d = dlts->data;
+	char *delta, *from, *to = NULL;
+	int len = 0, retval = -1;
+
+	delta = _alam_filecache_find(d->delta);
+	/* the initial package might be in a different cachedir */
+	if(dlts == delta_path) {
+		from = _alam_filecache_find(d->from);
+	} else {
+		/* len = cachedir len + from len + '/' + null */
+		len = strlen(cachedir) + strlen(d->from) + 2;
+		CALLOC(from, len, sizeof(char), goto cleanup);
+		snprintf(from, len, "%s/%s", cachedir, d->from);
+	}
+	len = strlen(cachedir) + strlen(d->to) + 2;
+	CALLOC(to, len, sizeof(char), goto cleanup);
+	snprintf(to, len, "%s/%s", cachedir, d->to);
+
+	retval = _alam_delta_apply(from, delta, to);
+	if(retval == 0) {
+		/* delete the delta file */
+		unlink(delta);
+		_alam_checksum_forget(delta);
+
+		/* Delete the 'from' package but only if it is an intermediate
+		 * package. The starting 'from' package should be kept, just
+		 * as if deltas were not used. */
+		if(dlts != delta_path) {
+			unlink(from);
+			_alam_checksum_forget(from);
+		}
+	}
+
+cleanup:
+	FREE(from);
+	FREE(to);
+	FREE(delta);
+	return(retval);
+}
+
+static void *patch_worker(void *arg)
 {
-	const char *s = filename + strlen(filename) - strlen(extension);
-	return(strcmp(s, extension) == 0);
+	struct patch_pool *pool = arg;
+	struct patch_job *job;
+	alam_list_t *dlts;
+	int ret;
+
+	for(;;) {
+		pthread_mutex_lock(&pool->lock);
+		job = pool->next < pool->count ? &pool->jobs[pool->next++] : NULL;
+		pthread_mutex_unlock(&pool->lock);
+		if(job == NULL) {
+			break;
+		}
+		/* the deltas of a chain depend on each other */
+		for(dlts = job->delta_path; dlts; dlts = dlts->next) {
+			ret = apply_delta(job->delta_path, dlts, pool->cachedir);
+			pthread_mutex_lock(&pool->lock);
+			if(ret == 0) {
+				job->applied++;
+			} else {
+				job->failed = 1;
+			}
+			pthread_cond_broadcast(&pool->progress);
+			pthread_mutex_unlock(&pool->lock);
+			if(ret != 0) {
+				/* one delta failed for this package, cancel the remaining ones */
+				break;
+			}
+		}
+	}
+	return(NULL);
 }
 
 /** Applies delta files to create an upgraded package file.
@@ -597,120 +813,386 @@ static int endswith(const char *filename, const char *extension)
  * All intermediate files are deleted, leaving only the starting and
  * ending package files.
  *
+ * The packages are patched by up to one thread per core, the deltas of
+ * a package in turn. The events are all sent from the calling thread, in
+ * target order, as the deltas they report on get applied.
+ *
  * @param trans the transaction
  *
  * @return 0 if all delta files were able to be applied, 1 otherwise.
  */
 static int apply_deltas(amtrans_t *trans)
 {
-	alam_list_t *i;
-	int ret = 0;
-	const char *cachedir = _alam_filecache_setup();
+	alam_list_t *i, *dlts;
+	struct patch_pool pool;
+	struct patch_job *jobs;
+	pthread_t *workers = NULL;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int count = 0, nworkers, started = 0, ret = 0, k, n;
 
 	for(i = trans->add; i; i = i->next) {
 		ampkg_t *spkg = i->data;
-		alam_list_t *delta_path = spkg->delta_path;
-		alam_list_t *dlts = NULL;
+		if(spkg->delta_path) {
+			count++;
+		}
+	}
+	if(count == 0) {
+		return(0);
+	}
+	CALLOC(jobs, count, sizeof(struct patch_job), RET_ERR(AM_ERR_MEMORY, 1));
+	for(i = trans->add, k = 0; i; i = i->next) {
+		ampkg_t *spkg = i->data;
+		if(spkg->delta_path) {
+			jobs[k++].delta_path = spkg->delta_path;
+		}
+	}
 
-		if(!delta_path) {
-			continue;
+	pool.cachedir = _alam_filecache_setup();
+	pool.jobs = jobs;
+	pool.count = count;
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.progress, NULL);
+
+	nworkers = (ncpu > 0 && ncpu < count) ? (int)ncpu : count;
+	CALLOC(workers, nworkers, sizeof(pthread_t), nworkers = 0);
+	for(k = 0; k < nworkers; k++) {
+		if(pthread_create(&workers[started], NULL, patch_worker, &pool) == 0) {
+			started++;
 		}
+	}
+	if(started == 0) {
+		/* patch everything here, the events follow */
+		patch_worker(&pool);
+	}
+	_alam_log(AM_LOG_DEBUG, "applying deltas to %d packages with %d threads\n",
+			count, started ? started : 1);
 
-		for(dlts = delta_path; dlts; dlts = dlts->next) {
-			amdelta_t *d = dlts->data;
-			char *delta, *from, *to;
-			char command[PATH_MAX];
-			int len = 0;
-
-			delta = _alam_filecache_find(d->delta);
-			/* the initial package might be in a different cachedir */
-			if(dlts == delta_path) {
-				from = _alam_filecache_find(d->from);
-			} else {
-				/* len = cachedir len + from len + '/' + null */
-				len = strlen(cachedir) + strlen(d->from) + 2;
-				CALLOC(from, len, sizeof(char), RET_ERR(AM_ERR_MEMORY, 1));
-				snprintf(from, len, "%s/%s", cachedir, d->from);
-			}
-			len = strlen(cachedir) + strlen(d->to) + 2;
-			CALLOC(to, len, sizeof(char), RET_ERR(AM_ERR_MEMORY, 1));
-			snprintf(to, len, "%s/%s", cachedir, d->to);
-
-			/* build the patch command */
-			if(endswith(to, ".gz")) {
-				/* special handling for gzip : we disable timestamp with -n option */
-				snprintf(command, PATH_MAX, "xdelta3 -d -q -R -c -s %s %s | gzip -n > %s", from, delta, to);
-			} else {
-				snprintf(command, PATH_MAX, "xdelta3 -d -q -s %s %s %s", from, delta, to);
-			}
+	for(k = 0; k < count; k++) {
+		struct patch_job *job = &jobs[k];
 
-			_alam_log(AM_LOG_DEBUG, "command: %s\n", command);
+		for(dlts = job->delta_path, n = 0; dlts; dlts = dlts->next, n++) {
+			amdelta_t *d = dlts->data;
+			int applied;
 
 			EVENT(trans, AM_TRANS_EVT_DELTA_PATCH_START, d->to, d->delta);
 
-			int retval = system(command);
-			if(retval == 0) {
-				EVENT(trans, AM_TRANS_EVT_DELTA_PATCH_DONE, NULL, NULL);
-
-				/* delete the delta file */
-				unlink(delta);
-
-				/* Delete the 'from' package but only if it is an intermediate
-				 * package. The starting 'from' package should be kept, just
-				 * as if deltas were not used. */
-				if(dlts != delta_path) {
-					unlink(from);
-				}
+			pthread_mutex_lock(&pool.lock);
+			while(job->applied <= n && !job->failed) {
+				pthread_cond_wait(&pool.progress, &pool.lock);
 			}
-			FREE(from);
-			FREE(to);
-			FREE(delta);
+			applied = (job->applied > n);
+			pthread_mutex_unlock(&pool.lock);
 
-			if(retval != 0) {
-				/* one delta failed for this package, cancel the remaining ones */
+			if(!applied) {
 				EVENT(trans, AM_TRANS_EVT_DELTA_PATCH_FAILED, NULL, NULL);
 				ret = 1;
 				break;
 			}
+			EVENT(trans, AM_TRANS_EVT_DELTA_PATCH_DONE, NULL, NULL);
 		}
 	}
 
+	for(k = 0; k < started; k++) {
+		pthread_join(workers[k], NULL);
+	}
+	pthread_cond_destroy(&pool.progress);
+	pthread_mutex_destroy(&pool.lock);
+	FREE(workers);
+	FREE(jobs);
+
 	return(ret);
 }
 
-/** Compares the md5sum of a file to the expected value.
- *
- * If the md5sum does not match, the user is asked whether the file
- * should be deleted.
+/* a file whose checksum is tested by verify_checksums() */
+struct verify_job {
+	const char *filename;
+	char *filepath;
+	const char *md5sum;
+	const char *sha256sum;
+	int memoized;           /* known good from the checksum memo */
+	int ret;                /* result of _alam_test_checksum() */
+};
+
+struct verify_pool {
+	pthread_mutex_t lock;
+	struct verify_job *jobs;
+	int count;
+	int next;
+};
+
+static void *verify_worker(void *arg)
+{
+	struct verify_pool *pool = arg;
+	struct verify_job *job;
+
+	for(;;) {
+		pthread_mutex_lock(&pool->lock);
+		job = pool->next < pool->count ? &pool->jobs[pool->next++] : NULL;
+		pthread_mutex_unlock(&pool->lock);
+		if(job == NULL) {
+			break;
+		}
+		if(!job->memoized) {
+			job->ret = _alam_test_checksum(job->filepath, job->md5sum,
+					job->sha256sum);
+		}
+	}
+	return(NULL);
+}
+
+/** Computes the checksums of a set of files, one file per core at a time.
  *
- * @param trans the transaction
- * @param filename the filename of the file to test
- * @param md5sum the expected md5sum of the file
+ * Only the checksums are computed here; the results are stored in each
+ * job and handled by check_result() in order afterwards, so the user sees
+ * the same questions and error list as with a serial check.
  *
- * @return 0 if the md5sum matched, 1 if not, -1 in case of errors
+ * @param jobs the files to test
+ * @param count the number of jobs
  */
-static int test_md5sum(amtrans_t *trans, const char *filename,
-		const char *md5sum)
+static void verify_checksums(struct verify_job *jobs, int count)
 {
-	char *filepath;
-	int ret;
+	struct verify_pool pool;
+	pthread_t *workers = NULL;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	int nworkers, started = 0, pending = 0, k;
+
+	for(k = 0; k < count; k++) {
+		if(!jobs[k].memoized) {
+			pending++;
+		}
+	}
+	if(pending == 0) {
+		return;
+	}
+	nworkers = (ncpu > 1 && ncpu < pending) ? (int)ncpu : pending;
+	if(nworkers > 1) {
+		CALLOC(workers, nworkers - 1, sizeof(pthread_t), nworkers = 1);
+	}
+
+	pool.jobs = jobs;
+	pool.count = count;
+	pool.next = 0;
+	pthread_mutex_init(&pool.lock, NULL);
 
-	filepath = _alam_filecache_find(filename);
+	for(k = 0; k < nworkers - 1; k++) {
+		if(pthread_create(&workers[started], NULL, verify_worker, &pool) == 0) {
+			started++;
+		}
+	}
+	_alam_log(AM_LOG_DEBUG, "checking %d files with %d threads\n",
+			pending, started + 1);
 
-	ret = _alam_test_md5sum(filepath, md5sum);
+	/* the calling thread takes its share of the files as well */
+	verify_worker(&pool);
+	for(k = 0; k < started; k++) {
+		pthread_join(workers[k], NULL);
+	}
 
-	if(ret == 1) {
+	pthread_mutex_destroy(&pool.lock);
+	FREE(workers);
+}
+
+/** Handles the outcome of a checksum test.
+ *
+ * If the checksum does not match, the user is asked whether the file
+ * should be deleted.
+ *
+ * @param trans the transaction
+ * @param job the tested file
+ *
+ * @return 0 if the checksum matched, 1 if not, -1 in case of errors
+ */
+static int check_result(amtrans_t *trans, struct verify_job *job)
+{
+	if(job->ret == 1) {
 		int doremove = 0;
-		QUESTION(trans, AM_TRANS_CONV_CORRUPTED_PKG, (char *)filename,
+		QUESTION(trans, AM_TRANS_CONV_CORRUPTED_PKG, (char *)job->filename,
 				NULL, NULL, &doremove);
 		if(doremove) {
-			unlink(filepath);
+			unlink(job->filepath);
+			_alam_checksum_forget(job->filepath);
 		}
 	}
 
-	FREE(filepath);
+	return(job->ret);
+}
 
-	return(ret);
+/* Marks the jobs whose files are known good from the checksum memo, so
+ * that no thread is started for them. */
+static void lookup_checksums(struct verify_job *jobs, int count)
+{
+	int k;
+
+	for(k = 0; k < count; k++) {
+		struct verify_job *job = &jobs[k];
+		amhashtype_t type = AM_HASH_MD5;
+		const char *expected = job->md5sum;
+		char *sum;
+
+		if(job->sha256sum != NULL && *job->sha256sum != '\0') {
+			type = AM_HASH_SHA256;
+			expected = job->sha256sum;
+		}
+		sum = _alam_checksum_stored(job->filepath, type);
+		if(sum != NULL && expected != NULL && strcasecmp(sum, expected) == 0) {
+			_alam_log(AM_LOG_DEBUG, "%s is unchanged since it was verified\n",
+					job->filepath);
+			job->memoized = 1;
+			job->ret = 0;
+		}
+		FREE(sum);
+	}
+}
+
+static void free_jobs(struct verify_job *jobs, int count)
+{
+	int k;
+
+	for(k = 0; k < count; k++) {
+		FREE(jobs[k].filepath);
+	}
+	FREE(jobs);
+}
+
+/** Moves the file list of a sync package to its loaded package file.
+ *
+ * The checksum of the package file was just checked against the same
+ * sync db, so its file list can be trusted and the archive does not need
+ * to be read through.
+ *
+ * @param spkg the package from the sync db
+ * @param pkgfile the package loaded without its file list
+ *
+ * @return 0 on success, -1 on error
+ */
+static int take_db_files(ampkg_t *spkg, ampkg_t *pkgfile)
+{
+	alam_list_t *i;
+
+	if(_alam_db_read(spkg->origin_data.db, spkg, INFRQ_FILES) != 0) {
+		return(-1);
+	}
+	FREELIST(pkgfile->files);
+	if(spkg->arena) {
+		/* the strings belong to the db, the package file needs its own */
+		pkgfile->files = alam_list_strdup(spkg->files);
+		alam_list_free(spkg->files);
+	} else {
+		pkgfile->files = spkg->files;
+	}
+	spkg->files = NULL;
+	spkg->infolevel &= ~INFRQ_FILES;
+
+	/* "checking for conflicts" requires a sorted list; repo-add writes one,
+	 * so only sort when needed */
+	for(i = pkgfile->files; i && i->next; i = i->next) {
+		if(_alam_str_cmp(i->data, i->next->data) > 0) {
+			_alam_log(AM_LOG_DEBUG, "sorting package filelist for %s\n",
+					pkgfile->name);
+			pkgfile->files = alam_list_msort(pkgfile->files,
+					alam_list_count(pkgfile->files), _alam_str_cmp);
+			break;
+		}
+	}
+	pkgfile->infolevel = INFRQ_ALL;
+	return(0);
+}
+
+/* Creates a private directory in parent, which ends with a slash.
+ * The returned path ends with a slash as well. */
+static char *make_tempdir(const char *parent)
+{
+	char *dir;
+
+	/* parent + 'alam-XXXXXX/' + null */
+	CALLOC(dir, strlen(parent) + 13, sizeof(char), return(NULL));
+	sprintf(dir, "%salam-XXXXXX", parent);
+	if(mkdtemp(dir) == NULL) {
+		FREE(dir);
+		return(NULL);
+	}
+	strcat(dir, "/");
+	return(dir);
+}
+
+/* The uncompressed copies of the packages, see _alam_pkg_load_spooled(),
+ * may take half of the room left where they are kept; the rest is left
+ * for the packages being installed. */
+static off_t spool_room(const char *dir)
+{
+	struct statvfs fs;
+
+	if(dir == NULL || statvfs(dir, &fs) != 0) {
+		return(0);
+	}
+	return((off_t)((uintmax_t)fs.f_bavail * fs.f_frsize / 2));
+}
+
+/* Whether dir has room for size bytes of packages. */
+static int stage_fits(const char *dir, off_t size)
+{
+	struct statvfs fs;
+
+	if(statvfs(dir, &fs) != 0) {
+		return(0);
+	}
+	/* keep some room for deltas and partial downloads */
+	return((uintmax_t)fs.f_bavail * fs.f_frsize >= (uintmax_t)(size + size / 4));
+}
+
+/** Sets up a staging directory for the packages of a transaction.
+ *
+ * The directory is made in the stage dir, or in the cachedir when no
+ * stage dir is set or it is too small. It is put first in the cachedirs,
+ * so downloads go there and packages found in a real cachedir are still
+ * used from where they are. The packages are dropped once installed.
+ *
+ * @param size the total download size of the transaction
+ *
+ * @return the directory, NULL if there is not enough room
+ */
+static char *stream_setup(off_t size)
+{
+	const char *parent = NULL;
+	char *dir;
+
+	if(handle->stagedir) {
+		if(stage_fits(handle->stagedir, size)) {
+			parent = handle->stagedir;
+		} else {
+			_alam_log(AM_LOG_DEBUG, "not enough room in %s\n", handle->stagedir);
+		}
+	}
+	if(parent == NULL) {
+		const char *cachedir = _alam_filecache_setup();
+		if(cachedir && stage_fits(cachedir, size)) {
+			parent = cachedir;
+		} else {
+			_alam_log(AM_LOG_DEBUG, "not enough room to stage packages, "
+					"using the cache\n");
+			return(NULL);
+		}
+	}
+
+	if((dir = make_tempdir(parent)) == NULL) {
+		return(NULL);
+	}
+
+	handle->cachedirs = alam_list_join(alam_list_add(NULL, strdup(dir)),
+			handle->cachedirs);
+	_alam_log(AM_LOG_DEBUG, "staging packages in %s\n", dir);
+	return(dir);
+}
+
+static void stream_cleanup(char *dir)
+{
+	char *data = NULL;
+
+	handle->cachedirs = alam_list_remove_str(handle->cachedirs, dir, &data);
+	FREE(data);
+	_alam_rmrf(dir);
+	FREE(dir);
 }
 
 int _alam_sync_commit(amtrans_t *trans, amdb_t *db_local, alam_list_t **data)
@@ -720,25 +1202,39 @@ int _alam_sync_commit(amtrans_t *trans, amdb_t *db_local, alam_list_t **data)
 	int replaces = 0;
 	int errors = 0;
 	const char *cachedir = NULL;
+	struct verify_job *jobs = NULL;
+	char *streamdir = NULL, *spooldir = NULL;
+	off_t spoolroom = 0;
+	int njobs = 0, k;
 	int ret = -1;
 
 	ALAM_LOG_FUNC;
 
 	ASSERT(trans != NULL, RET_ERR(AM_ERR_TRANS_NULL, -1));
 
+	/* Total progress - figure out the total download size. The callback is
+	 * called once with it, and it is up to the frontend to compute
+	 * incremental progress. */
+	off_t total_size = (off_t)0;
+	/* sum up the download size for each package and store total */
+	for(i = trans->add; i; i = i->next) {
+		ampkg_t *spkg = i->data;
+		total_size += spkg->download_size;
+	}
+
+	/* the checksum memo lives in the real cache, even while streaming */
+	_alam_checksum_load();
+
+	/* packages that are only downloaded to be kept must go to the cache */
+	if(handle->streaminstall && total_size > 0
+			&& !(trans->flags & AM_TRANS_FLAG_DOWNLOADONLY)) {
+		streamdir = stream_setup(total_size);
+	}
+
 	cachedir = _alam_filecache_setup();
 	trans->state = STATE_DOWNLOADING;
 
-	/* Total progress - figure out the total download size if required to
-	 * pass to the callback. This function is called once, and it is up to the
-	 * frontend to compute incremental progress. */
 	if(handle->totaldlcb) {
-		off_t total_size = (off_t)0;
-		/* sum up the download size for each package and store total */
-		for(i = trans->add; i; i = i->next) {
-			ampkg_t *spkg = i->data;
-			total_size += spkg->download_size;
-		}
 		handle->totaldlcb(total_size);
 	}
 
@@ -753,7 +1249,11 @@ int _alam_sync_commit(amtrans_t *trans, amdb_t *db_local, alam_list_t **data)
 				const char *fname = NULL;
 
 				fname = alam_pkg_get_filename(spkg);
-				ASSERT(fname != NULL, RET_ERR(AM_ERR_PKG_INVALID_NAME, -1));
+				if(fname == NULL) {
+					/* the stream dir has to go as well */
+					am_errno = AM_ERR_PKG_INVALID_NAME;
+					goto cleanup;
+				}
 				alam_list_t *delta_path = spkg->delta_path;
 				if(delta_path) {
 					/* using deltas */
@@ -790,7 +1290,7 @@ int _alam_sync_commit(amtrans_t *trans, amdb_t *db_local, alam_list_t **data)
 				if(am_errno == 0) {
 					am_errno = AM_ERR_RETRIEVE;
 				}
-				goto error;
+				goto cleanup;
 			}
 			FREELIST(files);
 		}
@@ -800,6 +1300,9 @@ int _alam_sync_commit(amtrans_t *trans, amdb_t *db_local, alam_list_t **data)
 	if(handle->totaldlcb) {
 		handle->totaldlcb(0);
 	}
+	if(handle->rankmirrors) {
+		_alam_mirror_save();
+	}
 
 	/* if we have deltas to work with */
 	if(handle->usedelta && deltas) {
@@ -808,19 +1311,29 @@ int _alam_sync_commit(amtrans_t *trans, amdb_t *db_local, alam_list_t **data)
 		/* Check integrity of deltas */
 		EVENT(trans, AM_TRANS_EVT_DELTA_INTEGRITY_START, NULL, NULL);
 
-		for(i = deltas; i; i = i->next) {
+		CALLOC(jobs, alam_list_count(deltas), sizeof(struct verify_job),
+				am_errno = AM_ERR_MEMORY; goto cleanup);
+		for(i = deltas, njobs = 0; i; i = i->next, njobs++) {
 			amdelta_t *d = alam_list_getdata(i);
-			const char *filename = alam_delta_get_filename(d);
-			const char *md5sum = alam_delta_get_md5sum(d);
+			jobs[njobs].filename = alam_delta_get_filename(d);
+			jobs[njobs].filepath = _alam_filecache_find(jobs[njobs].filename);
+			jobs[njobs].md5sum = alam_delta_get_md5sum(d);
+		}
+		lookup_checksums(jobs, njobs);
+		verify_checksums(jobs, njobs);
 
-			if(test_md5sum(trans, filename, md5sum) != 0) {
+		for(k = 0; k < njobs; k++) {
+			if(check_result(trans, &jobs[k]) != 0) {
 				errors++;
-				*data = alam_list_add(*data, strdup(filename));
+				*data = alam_list_add(*data, strdup(jobs[k].filename));
 			}
 		}
+		free_jobs(jobs, njobs);
+		jobs = NULL;
+		njobs = 0;
 		if(errors) {
 			am_errno = AM_ERR_DLT_INVALID;
-			goto error;
+			goto cleanup;
 		}
 		EVENT(trans, AM_TRANS_EVT_DELTA_INTEGRITY_DONE, NULL, NULL);
 
@@ -831,7 +1344,7 @@ int _alam_sync_commit(amtrans_t *trans, amdb_t *db_local, alam_list_t **data)
 
 		if(ret) {
 			am_errno = AM_ERR_DLT_PATCHFAILED;
-			goto error;
+			goto cleanup;
 		}
 	}
 
@@ -839,44 +1352,82 @@ int _alam_sync_commit(amtrans_t *trans, amdb_t *db_local, alam_list_t **data)
 	EVENT(trans, AM_TRANS_EVT_INTEGRITY_START, NULL, NULL);
 
 	errors = 0;
+	if(trans->add) {
+		CALLOC(jobs, alam_list_count(trans->add), sizeof(struct verify_job),
+				am_errno = AM_ERR_MEMORY; goto cleanup);
+	}
 	for(i = trans->add; i; i = i->next) {
 		ampkg_t *spkg = i->data;
 		if(spkg->origin == PKG_FROM_FILE) {
 			continue; /* pkg_load() has been already called, this package is valid */
 		}
+		jobs[njobs].filename = alam_pkg_get_filename(spkg);
+		jobs[njobs].filepath = _alam_filecache_find(jobs[njobs].filename);
+		jobs[njobs].md5sum = alam_pkg_get_md5sum(spkg);
+		jobs[njobs].sha256sum = alam_pkg_get_sha256sum(spkg);
+		njobs++;
+	}
+	lookup_checksums(jobs, njobs);
+	verify_checksums(jobs, njobs);
 
-		const char *filename = alam_pkg_get_filename(spkg);
-		const char *md5sum = alam_pkg_get_md5sum(spkg);
+	/* results are handled in target order, whatever order they came in */
+	for(i = trans->add, k = 0; i; i = i->next) {
+		ampkg_t *spkg = i->data;
+		if(spkg->origin == PKG_FROM_FILE) {
+			continue;
+		}
+		struct verify_job *job = &jobs[k++];
 
-		if(test_md5sum(trans, filename, md5sum) != 0) {
+		if(check_result(trans, job) != 0) {
 			errors++;
-			*data = alam_list_add(*data, strdup(filename));
+			*data = alam_list_add(*data, strdup(job->filename));
 			continue;
 		}
 		/* load the package file and replace pkgcache entry with it in the target list */
 		/* TODO: alam_pkg_get_db() will not work on this target anymore */
 		_alam_log(AM_LOG_DEBUG, "replacing pkgcache entry with package file for target %s\n", spkg->name);
-		char *filepath = _alam_filecache_find(filename);
 		ampkg_t *pkgfile;
-		if(alam_pkg_load(filepath, 1, &pkgfile) != 0) {
+		/* the whole archive is only read for its file list, which the sync
+		 * db may already have; if not, the decompressed package is kept for
+		 * the extraction */
+		int dbfiles = _alam_db_has_files(spkg->origin_data.db, spkg);
+		int loaded;
+		if(dbfiles) {
+			loaded = alam_pkg_load(job->filepath, 0, &pkgfile) == 0
+				&& take_db_files(spkg, pkgfile) == 0;
+		} else {
+			if(spooldir == NULL && !(trans->flags & AM_TRANS_FLAG_DOWNLOADONLY)) {
+				spooldir = make_tempdir(cachedir);
+				spoolroom = spool_room(spooldir);
+			}
+			if(spooldir) {
+				loaded = _alam_pkg_load_spooled(job->filepath, spooldir, &spoolroom,
+						&pkgfile) == 0;
+			} else {
+				loaded = alam_pkg_load(job->filepath, 1, &pkgfile) == 0;
+			}
+		}
+		if(!loaded) {
 			_alam_pkg_free(pkgfile);
 			errors++;
-			*data = alam_list_add(*data, strdup(filename));
-			FREE(filepath);
+			*data = alam_list_add(*data, strdup(job->filename));
 			continue;
 		}
-		FREE(filepath);
 		pkgfile->reason = spkg->reason; /* copy over install reason */
 		i->data = pkgfile;
 		_alam_pkg_free_trans(spkg); /* spkg has been removed from the target list */
 	}
+	free_jobs(jobs, njobs);
+	jobs = NULL;
+	njobs = 0;
 	if(errors) {
 		am_errno = AM_ERR_PKG_INVALID;
-		goto error;
+		goto cleanup;
 	}
 	EVENT(trans, AM_TRANS_EVT_INTEGRITY_DONE, NULL, NULL);
 	if(trans->flags & AM_TRANS_FLAG_DOWNLOADONLY) {
-		return(0);
+		ret = 0;
+		goto cleanup;
 	}
 
 	trans->state = STATE_COMMITING;
@@ -898,7 +1449,7 @@ int _alam_sync_commit(amtrans_t *trans, amdb_t *db_local, alam_list_t **data)
 				alam_list_free_inner(conflict, (alam_list_fn_free)_alam_fileconflict_free);
 				alam_list_free(conflict);
 			}
-			goto error;
+			goto cleanup;
 		}
 
 		EVENT(trans, AM_TRANS_EVT_FILECONFLICTS_DONE, NULL, NULL);
@@ -910,7 +1461,7 @@ int _alam_sync_commit(amtrans_t *trans, amdb_t *db_local, alam_list_t **data)
 		/* we want the frontend to be aware of commit details */
 		if(_alam_remove_packages(trans, handle->db_local) == -1) {
 			_alam_log(AM_LOG_ERROR, _("could not commit removal transaction\n"));
-			goto error;
+			goto cleanup;
 		}
 	}
 
@@ -918,11 +1469,21 @@ int _alam_sync_commit(amtrans_t *trans, amdb_t *db_local, alam_list_t **data)
 	_alam_log(AM_LOG_DEBUG, "installing packages\n");
 	if(_alam_upgrade_packages(trans, handle->db_local) == -1) {
 		_alam_log(AM_LOG_ERROR, _("could not commit transaction\n"));
-		goto error;
+		goto cleanup;
 	}
 	ret = 0;
 
-error:
+cleanup:
+	free_jobs(jobs, njobs);
+	if(spooldir) {
+		_alam_rmrf(spooldir);
+		FREE(spooldir);
+	}
+	if(streamdir) {
+		stream_cleanup(streamdir);
+	}
+	/* files checked by this attempt are not hashed again by the next */
+	_alam_checksum_save();
 	FREELIST(files);
 	alam_list_free(deltas);
 	return(ret);
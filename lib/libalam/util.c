@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <strings.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <ctype.h>
@@ -53,7 +54,9 @@
 #include "package.h"
 #include "alam.h"
 #include "alam_list.h"
-#include "md5.h"
+#include "hash.h"
+#include "checksum.h"
+#include "decompress.h"
 #include "handle.h"
 
 /* #ifndef HAVE_STRSEP */
@@ -347,18 +350,8 @@ int SYMEXPORT alam_unpack(const char *archive, const char *prefix, const char *f
 	/* ALAM_LOG_FUNC; */
     if (fn == NULL)
         printf("ARCHIVE_INSIDE: %s, LOCATION: %s\n", archive, prefix);
-	if((_archive = archive_read_new()) == NULL)
-    printf("TEST1\n");
-		/* RET_ERR(AM_ERR_LIBARCHIVE, 1); */
-
-	archive_read_support_compression_all(_archive);
-	archive_read_support_format_all(_archive);
-
-	if(archive_read_open_filename(_archive, archive,
-				ARCHIVE_DEFAULT_BYTES_PER_BLOCK) != ARCHIVE_OK) {
-		/* _alam_log(AM_LOG_ERROR, _("could not open %s: %s\n"), archive, */
-				/* archive_error_string(_archive)); */
-		/* RET_ERR(AM_ERR_PKG_OPEN, 1); */
+	if((_archive = _alam_archive_open(archive, NULL)) == NULL) {
+		return(1);
 	}
 
 	oldmask = umask(0022);
@@ -711,77 +704,151 @@ int _alam_lstat(const char *path, struct stat *buf)
  */
 char SYMEXPORT *alam_compute_md5sum(const char *filename)
 {
-	unsigned char output[16];
 	char *md5sum;
-	int ret, i;
 
 	ALAM_LOG_FUNC;
 
 	ASSERT(filename != NULL, return(NULL));
 
-	/* allocate 32 chars plus 1 for null */
-	md5sum = calloc(33, sizeof(char));
-	ret = md5_file(filename, output);
-
-	if (ret > 0) {
+	md5sum = _alam_hash_file(AM_HASH_MD5, filename);
+	if(md5sum == NULL) {
 		RET_ERR(AM_ERR_NOT_A_FILE, NULL);
 	}
 
-	/* Convert the result to something readable */
-	for (i = 0; i < 16; i++) {
-		/* sprintf is acceptable here because we know our output */
-		sprintf(md5sum +(i * 2), "%02x", output[i]);
-	}
-	md5sum[32] = '\0';
-
 	_alam_log(AM_LOG_DEBUG, "md5(%s) = %s\n", filename, md5sum);
 	return(md5sum);
 }
 
-int _alam_test_md5sum(const char *filepath, const char *md5sum)
+/** Get the sha256 sum of file.
+ * @param filename name of the file
+ * @return the checksum on success, NULL on error
+ * @addtogroup alam_misc
+ */
+char SYMEXPORT *alam_compute_sha256sum(const char *filename)
+{
+	char *sha256sum;
+
+	ALAM_LOG_FUNC;
+
+	ASSERT(filename != NULL, return(NULL));
+
+	sha256sum = _alam_hash_file(AM_HASH_SHA256, filename);
+	if(sha256sum == NULL) {
+		RET_ERR(AM_ERR_NOT_A_FILE, NULL);
+	}
+
+	_alam_log(AM_LOG_DEBUG, "sha256(%s) = %s\n", filename, sha256sum);
+	return(sha256sum);
+}
+
+/* Check a file against the strongest checksum we were given: sha256 when
+ * the repo provides one, md5 otherwise. */
+int _alam_test_checksum(const char *filepath, const char *md5sum,
+		const char *sha256sum)
 {
-	char *md5sum2;
+	amhashtype_t type = AM_HASH_MD5;
+	const char *expected = md5sum;
+	struct stat st;
+	char *sum;
 	int ret;
 
-	md5sum2 = alam_compute_md5sum(filepath);
+	if(filepath == NULL) {
+		return(-1);
+	}
+	if(sha256sum != NULL && *sha256sum != '\0') {
+		type = AM_HASH_SHA256;
+		expected = sha256sum;
+	}
+
+	/* files hashed while downloading or by an earlier check don't need to
+	 * be read again */
+	sum = _alam_checksum_stored(filepath, type);
+	if(sum != NULL) {
+		_alam_log(AM_LOG_DEBUG, "using stored %s of %s\n",
+				_alam_hash_name(type), filepath);
+	} else if(stat(filepath, &st) == 0) {
+		/* the file as it was before hashing, see _alam_checksum_store() */
+		if(type == AM_HASH_SHA256) {
+			sum = alam_compute_sha256sum(filepath);
+			_alam_checksum_store(filepath, &st, NULL, sum);
+		} else {
+			sum = alam_compute_md5sum(filepath);
+			_alam_checksum_store(filepath, &st, sum, NULL);
+		}
+	}
 
-	if(md5sum == NULL || md5sum2 == NULL) {
+	if(expected == NULL || sum == NULL) {
 		ret = -1;
-	} else if(strcmp(md5sum, md5sum2) != 0) {
+	} else if(strcasecmp(expected, sum) != 0) {
 		ret = 1;
 	} else {
 		ret = 0;
 	}
 
-	FREE(md5sum2);
+	FREE(sum);
 	return(ret);
 }
 
-char *_alam_archive_fgets(char *line, size_t size, struct archive *a)
+/** Read a line from an archive entry, like fgets().
+ * The entry is read a block at a time into b, which has to be used for
+ * all lines of the same entry. A line ends at a '\n' or a null byte.
+ * @param line buffer for the line
+ * @param size size of the line buffer; longer lines are split
+ * @param a the archive, pointed at the entry to read
+ * @param b read state for the entry
+ * @return line, or NULL at the end of the entry
+ */
+char *_alam_archive_fgets(char *line, size_t size, struct archive *a,
+		struct archive_read_buffer *b)
 {
-	/* for now, just read one char at a time until we get to a
-	 * '\n' char. we can optimize this later with an internal
-	 * buffer. */
 	/* leave room for zero terminator */
 	char *last = line + size - 1;
-	char *i;
-
-	for(i = line; i < last; i++) {
-		int ret = archive_read_data(a, i, 1);
-		/* special check for first read- if null, return null,
-		 * this indicates EOF */
-		if(i == line && (ret <= 0 || *i == '\0')) {
-			return(NULL);
+	char *i = line;
+	int done = 0;
+
+	while(!done && i < last) {
+		const char *start;
+		size_t n, k;
+
+		if(b->pos == b->len) {
+			ssize_t ret;
+			if(b->eof) {
+				break;
+			}
+			ret = archive_read_data(a, b->block, sizeof(b->block));
+			if(ret <= 0) {
+				b->eof = 1;
+				break;
+			}
+			b->pos = 0;
+			b->len = (size_t)ret;
 		}
-		/* check if read value was null or newline */
-		if(ret <= 0 || *i == '\0' || *i == '\n') {
-			last = i + 1;
-			break;
+
+		start = b->block + b->pos;
+		n = b->len - b->pos;
+		if(n > (size_t)(last - i)) {
+			n = last - i;
 		}
+		/* take everything up to and including the line end */
+		for(k = 0; k < n; k++) {
+			if(start[k] == '\n' || start[k] == '\0') {
+				k++;
+				done = 1;
+				break;
+			}
+		}
+		memcpy(i, start, k);
+		i += k;
+		b->pos += k;
+	}
+
+	/* nothing read, or a null byte right away, is the end */
+	if(i == line || *line == '\0') {
+		return(NULL);
 	}
 
 	/* always null terminate the buffer */
-	*last = '\0';
+	*i = '\0';
 
 	return(line);
 }
@@ -51,6 +51,17 @@
 	_alam_log(AM_LOG_DEBUG, "returning error %d from %s : %s\n", err, __func__, alam_strerrorlast()); \
 	return(ret); } while(0)
 
+/* Read state of _alam_archive_fgets() for one archive entry; initialize
+ * with ARCHIVE_READ_BUFFER_INIT. */
+struct archive_read_buffer {
+	char block[65536];
+	size_t pos;
+	size_t len;
+	int eof;
+};
+
+#define ARCHIVE_READ_BUFFER_INIT { .pos = 0, .len = 0, .eof = 0 }
+
 int _alam_makepath(const char *path);
 int _alam_copyfile(const char *src, const char *dest);
 char *_alam_strtrim(char *str);
@@ -64,8 +75,10 @@ int _alam_str_cmp(const void *s1, const void *s2);
 char *_alam_filecache_find(const char *filename);
 const char *_alam_filecache_setup(void);
 int _alam_lstat(const char *path, struct stat *buf);
-int _alam_test_md5sum(const char *filepath, const char *md5sum);
-char *_alam_archive_fgets(char *line, size_t size, struct archive *a);
+int _alam_test_checksum(const char *filepath, const char *md5sum,
+		const char *sha256sum);
+char *_alam_archive_fgets(char *line, size_t size, struct archive *a,
+		struct archive_read_buffer *b);
 
 #ifndef HAVE_STRSEP
 char *strsep(char **, const char *);
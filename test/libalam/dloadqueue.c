@@ -0,0 +1,341 @@
+/*
+ *  dloadqueue.c : runs the parallel download queue against a local server
+ *
+ *  Copyright (c) 2006-2009 Pacman Development Team <pacman-dev@archlinux.org>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h> /* intptr_t, intmax_t */
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* alam */
+#include <alam.h>
+#include <alam_list.h>
+#include "dload.h"
+
+/* exit status automake reads as a skipped test */
+#define SKIP 77
+
+#define NFILES 8
+#define PARALLEL 4
+#define MIRRORCONNS 2
+#define CHUNK 8192
+
+/* the stand-in server: /repo/ has the files, anything else is missing */
+static int listenfd = -1;
+static pthread_mutex_t srv_lock = PTHREAD_MUTEX_INITIALIZER;
+static int active = 0;
+static int maxactive = 0;
+
+/* what the frontend callbacks saw */
+static volatile int in_callback = 0;
+static int overlaps = 0;
+static int completed[NFILES + 1];
+
+static off_t file_size(int n)
+{
+	return((off_t)n * 64 * 1024 + n);
+}
+
+static unsigned char file_byte(int n, off_t pos)
+{
+	return((unsigned char)(pos * 31 + n));
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while(len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if(n <= 0) {
+			return(-1);
+		}
+		buf += n;
+		len -= n;
+	}
+	return(0);
+}
+
+static void serve_file(int fd, int n)
+{
+	char buf[CHUNK];
+	off_t size = file_size(n), pos = 0;
+	int len;
+
+	pthread_mutex_lock(&srv_lock);
+	if(++active > maxactive) {
+		maxactive = active;
+	}
+	pthread_mutex_unlock(&srv_lock);
+
+	len = snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n"
+			"Content-Length: %jd\r\nConnection: close\r\n\r\n", (intmax_t)size);
+	if(write_all(fd, buf, len) == 0) {
+		while(pos < size) {
+			int k;
+			len = size - pos < CHUNK ? (int)(size - pos) : CHUNK;
+			for(k = 0; k < len; k++) {
+				buf[k] = file_byte(n, pos + k);
+			}
+			if(write_all(fd, buf, len) != 0) {
+				break;
+			}
+			pos += len;
+			/* slow enough for transfers to overlap */
+			if(pos < size) {
+				usleep(2000);
+			}
+		}
+	}
+
+	pthread_mutex_lock(&srv_lock);
+	active--;
+	pthread_mutex_unlock(&srv_lock);
+}
+
+static void *serve_conn(void *data)
+{
+	int fd = (int)(intptr_t)data;
+	char req[4096];
+	size_t len = 0;
+	int n;
+
+	/* read the whole request, only its first line matters */
+	while(len < sizeof(req) - 1) {
+		ssize_t r = read(fd, req + len, sizeof(req) - 1 - len);
+		if(r <= 0) {
+			break;
+		}
+		len += r;
+		req[len] = '\0';
+		if(strstr(req, "\r\n\r\n")) {
+			break;
+		}
+	}
+	req[len] = '\0';
+
+	if(sscanf(req, "GET /repo/file%d ", &n) == 1 && n >= 1 && n <= NFILES) {
+		serve_file(fd, n);
+	} else {
+		const char *notfound = "HTTP/1.1 404 Not Found\r\n"
+			"Content-Length: 0\r\nConnection: close\r\n\r\n";
+		write_all(fd, notfound, strlen(notfound));
+	}
+	close(fd);
+	return(NULL);
+}
+
+static void *serve(void *data)
+{
+	(void)data;
+	while(1) {
+		pthread_t thread;
+		int fd = accept(listenfd, NULL, NULL);
+		if(fd < 0) {
+			continue;
+		}
+		if(pthread_create(&thread, NULL, serve_conn, (void *)(intptr_t)fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return(NULL);
+}
+
+static int start_server(void)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	pthread_t thread;
+
+	listenfd = socket(AF_INET, SOCK_STREAM, 0);
+	if(listenfd < 0) {
+		return(-1);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	if(bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+			|| listen(listenfd, 64) != 0
+			|| getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) != 0
+			|| pthread_create(&thread, NULL, serve, NULL) != 0) {
+		close(listenfd);
+		return(-1);
+	}
+	pthread_detach(thread);
+	return(ntohs(addr.sin_port));
+}
+
+/* neither callback may be entered while the other one runs */
+static void callback_enter(void)
+{
+	if(__sync_add_and_fetch(&in_callback, 1) != 1) {
+		__sync_add_and_fetch(&overlaps, 1);
+	}
+	/* widen the window for a concurrent call */
+	usleep(50);
+}
+
+static void callback_leave(void)
+{
+	__sync_sub_and_fetch(&in_callback, 1);
+}
+
+static void cb_log(amloglevel_t level, char *fmt, va_list args)
+{
+	(void)level;
+	(void)fmt;
+	(void)args;
+	/* the first server fails every file, which is logged as an error */
+	callback_enter();
+	callback_leave();
+}
+
+static void cb_dl(const char *filename, off_t xfered, off_t total)
+{
+	int n;
+
+	callback_enter();
+	if(sscanf(filename, "file%d", &n) == 1 && n >= 1 && n <= NFILES
+			&& total == file_size(n) && xfered == total) {
+		completed[n]++;
+	}
+	callback_leave();
+}
+
+static int check_file(const char *dir, int n)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	off_t pos = 0;
+	int c, ret = 0;
+
+	snprintf(path, sizeof(path), "%sfile%d", dir, n);
+	fp = fopen(path, "r");
+	if(fp == NULL) {
+		fprintf(stderr, "file%d: not downloaded\n", n);
+		return(-1);
+	}
+	while((c = fgetc(fp)) != EOF) {
+		if(pos >= file_size(n) || (unsigned char)c != file_byte(n, pos)) {
+			ret = -1;
+			break;
+		}
+		pos++;
+	}
+	fclose(fp);
+	unlink(path);
+	if(ret != 0 || pos != file_size(n)) {
+		fprintf(stderr, "file%d: wrong contents\n", n);
+		return(-1);
+	}
+	if(completed[n] == 0) {
+		fprintf(stderr, "file%d: progress never reached the end\n", n);
+		return(-1);
+	}
+	return(0);
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/dloadqueue.XXXXXX";
+	char localpath[PATH_MAX], missing[64], repo[64];
+	alam_list_t *files = NULL, *servers = NULL;
+	int port, errors, i, ret = 0;
+
+	(void)argc;
+	(void)argv;
+
+#if !defined(INTERNAL_DOWNLOAD) && !defined(CURL_DOWNLOAD)
+	/* nothing to test without a built-in downloader */
+	return(SKIP);
+#endif
+
+	port = start_server();
+	if(port < 0 || mkdtemp(dir) == NULL) {
+		fprintf(stderr, "could not set up the test\n");
+		return(SKIP);
+	}
+	snprintf(localpath, sizeof(localpath), "%s/", dir);
+	/* every file is first asked from a server that does not have it */
+	snprintf(missing, sizeof(missing), "http://127.0.0.1:%d/missing", port);
+	snprintf(repo, sizeof(repo), "http://127.0.0.1:%d/repo", port);
+
+	if(alam_initialize() == -1) {
+		fprintf(stderr, "failed to initialize alam library\n");
+		return(1);
+	}
+	alam_option_set_logcb(cb_log);
+	alam_option_set_dlcb(cb_dl);
+	alam_option_set_paralleldownloads(PARALLEL);
+	alam_option_set_maxmirrorconns(MIRRORCONNS);
+
+	for(i = 1; i <= NFILES; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "file%d", i);
+		files = alam_list_add(files, strdup(name));
+	}
+	servers = alam_list_add(servers, missing);
+	servers = alam_list_add(servers, repo);
+
+	errors = _alam_download_files(files, servers, localpath);
+	if(errors != 0) {
+		fprintf(stderr, "%d files could not be downloaded\n", errors);
+		ret = 1;
+	}
+	for(i = 1; i <= NFILES; i++) {
+		if(check_file(localpath, i) != 0) {
+			ret = 1;
+		}
+	}
+	if(overlaps != 0) {
+		fprintf(stderr, "callbacks entered concurrently %d times\n", overlaps);
+		ret = 1;
+	}
+	if(maxactive > MIRRORCONNS) {
+		fprintf(stderr, "%d transfers from one server, limit is %d\n",
+				maxactive, MIRRORCONNS);
+		ret = 1;
+	}
+#if defined(CURL_DOWNLOAD)
+	/* libfetch runs one transfer at a time (see _alam_download_files()) */
+	if(maxactive < 2) {
+		fprintf(stderr, "files were not downloaded in parallel\n");
+		ret = 1;
+	}
+#endif
+
+	alam_list_free(servers);
+	FREELIST(files);
+	alam_release();
+	rmdir(dir);
+
+	return(ret);
+}
+
+/* vim: set ts=2 sw=2 noet: */